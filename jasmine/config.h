@@ -8,7 +8,7 @@
 
 #include "jasmine.h"
 
-/* ssd configurations */
+/* ssd configurations; defaults of the run-time geometry of the simulator */
 #define VST_SECTORS_PER_PAGE SECTORS_PER_PAGE
 #define VST_PAGES_PER_BLOCK PAGES_PER_BLK
 #define VST_BLOCKS_PER_BANK VBLKS_PER_BANK
@@ -23,6 +23,10 @@
 
 #define VST_MAX_LBA (NUM_LSECTORS - 1)
 
+/* channel of bank i is VST_BANK_MAP[i] % VST_NUM_CHNLS */
+#define VST_NUM_CHNLS NUM_CHNLS_MAX
+#define VST_BANK_MAP BANK_MAP
+
 #define VST_DRAM_BASE DRAM_BASE
 #define VST_DRAM_SIZE DRAM_SIZE
 
@@ -1,60 +1,26 @@
-#!/usr/bin/python
+#!/usr/bin/env python3
 
-import re
 import sys
-import csv
+import vst_results
 
-def extract_trace(f):
-    ls = []
-    for l in f:
-        if re.search('Trace file', l):
-            ls.append(l.strip().split(' ')[2].split('/')[2].split('.')[0].split('-')[0])
-    f.seek(0)
-    return ls
-
-def extract_time(f):
-    ls = []
-    for l in f:
-        if re.search('real', l):
-            #t = l.strip().split('\t')
-            t = l.strip().split('\t')[1]
-            m = t.split('m')[0]
-            s = t.split('m')[1].split('s')[0]
-            ls.append(str(float(m) * 60 + float(s)))
-    f.seek(0)
-    return ls
-
-def extract_other(f, s, n):
-    ls = []
-    for l in f:
-        if re.search(s, l):
-            ls.append(l.strip().split(' ')[n])
-    f.seek(0)
-    return ls
+# trace, total read (MB), total write (MB), time (s), flash read, flash write,
+# flash copyback, flash erase
+FIELDS = ['trace.name', 'read_mb', 'write_mb', 'run.wall_s', 'stat.flash_read',
+          'stat.flash_write', 'stat.flash_copyback', 'stat.flash_erase']
 
 if len(sys.argv) != 3:
-    print 'usage: ' + __file__ + ' <FTL> <# jobs>'
+    print('usage: ' + __file__ + ' <FTL> <# jobs>')
     sys.exit(1)
 
 ftl = sys.argv[1]
 job = sys.argv[2]
-name_in = './output/' + ftl + '-para-j' + job + '.out'
+name_in = './output/' + ftl + '-para-j' + job + '.jsonl'
 name_out = './output/' + ftl + '-para-j' + job + '.csv'
-f = open(name_in, "r")
-
-trace = extract_trace(f)
-total_read = extract_other(f, 'Total read', 3)
-total_write = extract_other(f, 'Total write', 3)
-time = extract_time(f)
-nand_read = extract_other(f, 'Total flash read', 4)
-nand_write = extract_other(f, 'Total flash write', 4)
-nand_copyback = extract_other(f, 'Total flash copyback', 4)
-nand_erase = extract_other(f, 'Total flash erase', 4)
-
-data = zip(trace, total_read, total_write, time, nand_read, nand_write, nand_copyback, nand_erase)
 
-with open(name_out, 'wb') as ofile:
-    wr = csv.writer(ofile)
-    for row in data:
-        wr.writerow(row)
+rows = vst_results.load([name_in])
+for row in rows:
+    row['read_mb'] = row['stat.read_bytes'] // (1024 * 1024)
+    row['write_mb'] = row['stat.write_bytes'] // (1024 * 1024)
 
+with open(name_out, 'w', newline='') as ofile:
+    vst_results.write_csv(rows, FIELDS, ofile, header=False)
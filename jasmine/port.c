@@ -48,6 +48,26 @@ void vst_rwbuf_config(uint64_t *raddr, uint32_t *rsize, uint64_t *waddr, uint32_
     *wsize = NUM_WR_BUFFERS;
 }
 
+void vst_geometry_config(uint32_t *n_bank, uint32_t *blks_per_bank,
+                         uint32_t *pages_per_blk, uint32_t *sects_per_page,
+                         uint32_t *bytes_per_sect, uint64_t *max_lba)
+{
+    *n_bank = NUM_BANKS;
+    *blks_per_bank = VBLKS_PER_BANK;
+    *pages_per_blk = PAGES_PER_BLK;
+    *sects_per_page = SECTORS_PER_PAGE;
+    *bytes_per_sect = BYTES_PER_SECTOR;
+    *max_lba = NUM_LSECTORS - 1;
+}
+
+void vst_channel_config(uint32_t *chnl)
+{
+    static const UINT8 map[] = BANK_MAP;
+
+    for (UINT32 i = 0; i < NUM_BANKS; i++)
+        chnl[i] = map[i] % NUM_CHNLS_MAX;
+}
+
 /* flash wrappers */
 void nand_page_read(UINT32 const bank, UINT32 const vblock, 
                     UINT32 const page_num, UINT32 const buf_addr)
@@ -15,9 +15,14 @@ if [ ! -f ${OBJ} ]; then
 fi
 
 OPFILE=./output/${FTL}-para-j${JOB}.out
+# one JSON record per run, read by exp-para.py
+RESFILE=./output/${FTL}-para-j${JOB}.jsonl
+# parsed traces shared by all jobs and runs
+CACHE=./cache
 # 1 TB write
 STRESS=1099511627776
 
-rm ${OPFILE}
-parallel --no-notice -j${JOB} "./vst-jasmine {} ${OBJ} -b ${STRESS}" ::: ../traces/*.trace 2>&1 | tee -a ${OPFILE}
+rm -f ${OPFILE} ${RESFILE}
+mkdir -p ${CACHE}
+parallel --no-notice -j${JOB} "./vst-jasmine {} ${OBJ} -b ${STRESS} -t ${CACHE} -o ${RESFILE}" ::: ../traces/*.trace 2>&1 | tee -a ${OPFILE}
 
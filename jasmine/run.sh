@@ -14,11 +14,16 @@ if [ ! -f ${OBJ} ]; then
 fi
 
 OPFILE=./output/${FTL}.out
+# one JSON record per run, read by exp.py
+RESFILE=./output/${FTL}.jsonl
+# parsed traces shared by all runs
+CACHE=./cache
 
-rm ${OPFILE}
+rm -f ${OPFILE} ${RESFILE}
+mkdir -p ${CACHE}
 for t in ../traces/*.trace
 do
-    { time ./vst-jasmine ${t} ${OBJ} -a 2>&1 | tee -a ${OPFILE} ; } 2>>${OPFILE}
+    { time ./vst-jasmine ${t} ${OBJ} -a -t ${CACHE} -o ${RESFILE} 2>&1 | tee -a ${OPFILE} ; } 2>>${OPFILE}
     echo "" | tee -a ${OPFILE}
 done
 
@@ -0,0 +1,125 @@
+#!/usr/bin/env python3
+"""Merge the results files written by vst-jasmine -o into one CSV table.
+
+Each line of a results file is the JSON record of one run.  Nested fields
+are flattened to dotted column names such as stat.flash_erase or
+latency.write.p99_us.  Runs can be grouped by some columns, in which case
+the numeric columns are reduced to their mean, min or max over the group.
+"""
+
+import argparse
+import csv
+import json
+import os
+import sys
+
+
+def flatten(rec, prefix=''):
+    row = {}
+    for k, v in rec.items():
+        if isinstance(v, dict):
+            row.update(flatten(v, prefix + k + '.'))
+        else:
+            row[prefix + k] = v
+    return row
+
+
+def short_name(path):
+    """hm_0-aligned16.trace -> hm_0, ftl_greedy/ftl.so -> greedy"""
+    base = os.path.basename(path)
+    if base == 'ftl.so':
+        return os.path.basename(os.path.dirname(path)).replace('ftl_', '', 1)
+    return base.split('.')[0].split('-')[0]
+
+
+def load(files):
+    rows = []
+    for name in files:
+        f = sys.stdin if name == '-' else open(name)
+        for n, line in enumerate(f, 1):
+            if not line.strip():
+                continue
+            try:
+                row = flatten(json.loads(line))
+            except ValueError:
+                # a run killed while appending leaves a partial line
+                print('%s:%d: skipping malformed record' % (name, n),
+                      file=sys.stderr)
+                continue
+            row['trace.name'] = short_name(row.get('trace.path', ''))
+            row['ftl.name'] = short_name(row.get('ftl.path', ''))
+            rows.append(row)
+        if f is not sys.stdin:
+            f.close()
+    return rows
+
+
+def reduce_rows(rows, keys, how):
+    groups = {}
+    for row in rows:
+        groups.setdefault(tuple(row.get(k) for k in keys), []).append(row)
+    out = []
+    for key, members in groups.items():
+        row = dict(zip(keys, key))
+        row['runs'] = len(members)
+        cols = []
+        for m in members:
+            cols.extend(c for c in m if c not in cols)
+        for c in cols:
+            if c in row:
+                continue
+            vals = [m[c] for m in members if c in m]
+            nums = [v for v in vals if isinstance(v, (int, float))
+                    and not isinstance(v, bool)]
+            if nums and len(nums) == len(vals):
+                if how == 'min':
+                    row[c] = min(nums)
+                elif how == 'max':
+                    row[c] = max(nums)
+                else:
+                    row[c] = sum(nums) / len(nums)
+            elif all(v == vals[0] for v in vals):
+                row[c] = vals[0]
+        out.append(row)
+    return out
+
+
+def write_csv(rows, fields, out, header=True):
+    if not fields:
+        fields = []
+        for row in rows:
+            fields.extend(c for c in row if c not in fields)
+    wr = csv.writer(out)
+    if header:
+        wr.writerow(fields)
+    for row in rows:
+        wr.writerow(['' if row.get(c) is None else row.get(c)
+                     for c in fields])
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    ap.add_argument('files', nargs='+', help="results files, '-' for stdin")
+    ap.add_argument('-f', '--fields',
+                    help='comma-separated columns to print, in order')
+    ap.add_argument('-g', '--group',
+                    help='comma-separated columns to group runs by, '
+                         'e.g. ftl.name,trace.name')
+    ap.add_argument('-r', '--reduce', choices=('mean', 'min', 'max'),
+                    default='mean', help='how grouped numeric columns are '
+                    'reduced (default mean)')
+    ap.add_argument('-o', '--output', help='CSV file (default stdout)')
+    args = ap.parse_args()
+
+    rows = load(args.files)
+    if args.group:
+        rows = reduce_rows(rows, args.group.split(','), args.reduce)
+    fields = args.fields.split(',') if args.fields else None
+    out = open(args.output, 'w', newline='') if args.output else sys.stdout
+    write_csv(rows, fields, out)
+    if out is not sys.stdout:
+        out.close()
+
+
+if __name__ == '__main__':
+    main()
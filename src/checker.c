@@ -3,73 +3,375 @@
  * Authors: Yun-Sheng Chang
  */
 
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <stdarg.h>
+#include <inttypes.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "checker.h"
+#include "logger.h"
+#include "ring.h"
+
+/* words in the queue of each checker thread, a power of two */
+#define CHK_QUEUE_SIZE (1 << 20)
+/* how long a checker thread sleeps on an empty queue, in ns */
+#define CHK_IDLE_NS 100000
+
+/**
+ * A check event is type << 24 | n, the sequence number of the last event
+ * logged before it in two words, three arguments and n LBAs:
+ *   host write: LBA, sectors, -
+ *   host read: LBA, -, -, followed by the LBAs stored in the page
+ *   sequential write check: bank, blk, page
+ *   program: bank, blk, page
+ *   erase: bank, blk, -
+ */
+enum {CHK_EV_WRITE, CHK_EV_READ, CHK_EV_SEQ, CHK_EV_PROGRAM, CHK_EV_ERASE};
+#define CHK_EV_WORDS 6
+
+/**
+ * In asynchronous mode the simulation thread only queues check events and
+ * checker threads validate them against a shadow state of their own.  Host
+ * events go to the thread of their logical page and flash events to the
+ * thread of their bank, so each thread sees the events it depends on in
+ * order and no two threads update the same byte of the shadow state.  Each
+ * queue is a ring of words with a single producer and a single consumer.
+ */
+typedef struct {
+    spsc_t q;
+    uint32_t *buf;
+    pthread_t thread;
+} chk_queue_t;
 
 static int checkable[CHK_MAX];
+static chk_queue_t *queues;
+static uint32_t n_queues;
+static int stopping;
+/* set by the first checker thread to find a violation */
+static int failed;
+/* set once the simulation thread logs no more events */
+static int sim_parked;
+/* shadow state: LBAs ever written, and programmed pages by block */
+static uint8_t *written;
+static uint64_t *programmed;
+static uint32_t block_words;
 
-static void __attribute__((format(printf, 1, 2))) 
-violation(const char *fmt, ...)
+/* Sequence number of the last event logged, UINT64_MAX if none */
+static inline uint64_t last_seq(void)
 {
-    printf("Bug detected: ");
+    return event_seq - 1;
+}
+
+/**
+ * Stop the simulation thread, which runs ahead of the checker threads, so
+ * that the flight recorder holds still while it is dumped.  Only the first
+ * checker thread to fail returns; the process dies with its abort().
+ */
+static void stop_simulation(void)
+{
+    struct timespec idle = {0, CHK_IDLE_NS};
+
+    if (__atomic_exchange_n(&failed, 1, __ATOMIC_ACQ_REL)) {
+        for (;;)
+            pause();
+    }
+    while (!__atomic_load_n(&sim_parked, __ATOMIC_ACQUIRE))
+        nanosleep(&idle, NULL);
+}
+
+/* Called by the simulation thread once a checker thread failed */
+static void park(void)
+{
+    __atomic_store_n(&sim_parked, 1, __ATOMIC_RELEASE);
+    for (;;)
+        pause();
+}
+
+static void __attribute__((format(printf, 2, 3)))
+violation(uint64_t seq, const char *fmt, ...)
+{
+    /* queues are only set in asynchronous mode */
+    if (queues != NULL)
+        stop_simulation();
+    if (seq == UINT64_MAX)
+        printf("Bug detected: ");
+    else
+        printf("Bug detected at event #%" PRIu64 ": ", seq);
 
     va_list ap;
     va_start(ap, fmt);
     vfprintf(stdout, fmt, ap);
     va_end(ap);
+    /* the caller aborts, so leave the message and the events behind */
+    fflush(stdout);
+    dump_flight();
+    if (seq != UINT64_MAX && flight_on() && !flight_holds(seq)) {
+        printf("Event #%" PRIu64 " is not in the flight recorder.\n", seq);
+        fflush(stdout);
+    }
+}
+
+static void check_lbas(uint64_t seq, const uint8_t *wr, uint32_t lba,
+                       const uint32_t *lbas, uint32_t n_sect)
+{
+    for (uint32_t i = 0; i < n_sect; i++) {
+        if (wr[lba + i] && lba + i != lbas[i]) {
+            violation(seq, "LBA mismatched, issued LBA = %u, "
+                    "stored LBA = %u\n", lba + i, lbas[i]);
+            abort();
+        }
+    }
+}
+
+static void check_seq_write(uint64_t seq, uint32_t bank, uint32_t blk,
+                            uint32_t page, int prev_erased)
+{
+    if (page != 0 && prev_erased) {
+        violation(seq, "Non-sequential write to bank #%u, blk #%u, "
+                "page #%u\n", bank, blk, page);
+        abort();
+    }
+}
+
+static void check_overwrite(uint64_t seq, uint32_t bank, uint32_t blk,
+                            uint32_t page, int erased)
+{
+    if (!erased) {
+        violation(seq, "Directly overwrite to bank #%u , blk #%u, "
+                "page#%u\n", bank, blk, page);
+        abort();
+    }
+}
+
+static inline uint64_t *shadow_block(uint32_t bank, uint32_t blk)
+{
+    return &programmed[((uint64_t)bank * geo.blocks_per_bank + blk) *
+            block_words];
+}
+
+static inline int shadow_erased(uint32_t bank, uint32_t blk, uint32_t page)
+{
+    return !(shadow_block(bank, blk)[page / 64] >> (page % 64) & 1);
+}
+
+/* Validate a check event against the shadow state and apply it */
+static void check_event(const uint32_t *ev)
+{
+    uint32_t type = ev[0] >> 24, n = ev[0] & 0xffffff;
+    uint64_t seq = (uint64_t)ev[2] << 32 | ev[1];
+    uint32_t a = ev[3], b = ev[4], c = ev[5];
+
+    switch (type) {
+    case CHK_EV_WRITE:
+        for (uint32_t i = 0; i < b; i++)
+            written[a + i] = 1;
+        break;
+    case CHK_EV_READ:
+        check_lbas(seq, written, a, &ev[CHK_EV_WORDS], n);
+        break;
+    case CHK_EV_SEQ:
+        check_seq_write(seq, a, b, c, c != 0 && shadow_erased(a, b, c - 1));
+        break;
+    case CHK_EV_PROGRAM:
+        if (checkable[CHK_OVERWRITE])
+            check_overwrite(seq, a, b, c, shadow_erased(a, b, c));
+        shadow_block(a, b)[c / 64] |= (uint64_t)1 << (c % 64);
+        break;
+    case CHK_EV_ERASE:
+        for (uint32_t i = 0; i < block_words; i++)
+            shadow_block(a, b)[i] = 0;
+        break;
+    }
+}
+
+static void *run_checker(void *arg)
+{
+    struct timespec idle = {0, CHK_IDLE_NS};
+    chk_queue_t *q = (chk_queue_t *)arg;
+    uint32_t ev[CHK_EV_WORDS + VST_MAX_SECTORS_PER_PAGE];
+    uint64_t avail, tail;
+    uint32_t len;
+    int stop;
+
+    for (;;) {
+        /* the queue is drained once more after the stop request */
+        stop = __atomic_load_n(&stopping, __ATOMIC_ACQUIRE);
+        avail = spsc_avail(&q->q);
+        if (avail == 0) {
+            if (stop)
+                break;
+            nanosleep(&idle, NULL);
+            continue;
+        }
+        while (avail > 0) {
+            tail = q->q.tail;
+            len = CHK_EV_WORDS + (q->buf[spsc_idx(&q->q, tail)] & 0xffffff);
+            for (uint32_t i = 0; i < len; i++)
+                ev[i] = q->buf[spsc_idx(&q->q, tail + i)];
+            spsc_release(&q->q, len);
+            avail -= len;
+            check_event(ev);
+        }
+    }
+    return NULL;
 }
 
-int open_checker(void)
+/* What the simulation thread does while a checker queue is full */
+static int wait_checker(void)
+{
+    if (__atomic_load_n(&failed, __ATOMIC_RELAXED))
+        park();
+    sched_yield();
+    return 0;
+}
+
+/* Queue a check event for checker thread i, waiting for room if need be */
+static void push_event(uint32_t i, uint32_t type, uint32_t a, uint32_t b,
+                       uint32_t c, const uint32_t *lbas, uint32_t n)
+{
+    chk_queue_t *q = &queues[i];
+    uint64_t head, seq = last_seq();
+    uint32_t len = CHK_EV_WORDS + n;
+    uint32_t *buf = q->buf;
+
+    if (__atomic_load_n(&failed, __ATOMIC_RELAXED))
+        park();
+    spsc_reserve(&q->q, len, wait_checker);
+    head = q->q.head;
+    buf[spsc_idx(&q->q, head)] = type << 24 | n;
+    buf[spsc_idx(&q->q, head + 1)] = (uint32_t)seq;
+    buf[spsc_idx(&q->q, head + 2)] = (uint32_t)(seq >> 32);
+    buf[spsc_idx(&q->q, head + 3)] = a;
+    buf[spsc_idx(&q->q, head + 4)] = b;
+    buf[spsc_idx(&q->q, head + 5)] = c;
+    for (uint32_t j = 0; j < n; j++)
+        buf[spsc_idx(&q->q, head + CHK_EV_WORDS + j)] = lbas[j];
+    spsc_publish(&q->q, len);
+}
+
+/* checker thread of a logical page and of a bank */
+#define host_queue(lba) ((lba) / geo.sectors_per_page % n_queues)
+#define flash_queue(bank) ((bank) % n_queues)
+
+/**
+ * Check inline if n_threads is 0, otherwise on n_threads checker threads
+ * that lag behind the simulation
+ */
+int open_checker(uint32_t n_threads)
 {
     checkable[CHK_LPN_CONSISTENT] = ENABLE_CHK_LPN_CONSISTENT;
     checkable[CHK_NON_SEQ_WRITE] = ENABLE_CHK_NON_SEQ_WRITE;
     checkable[CHK_OVERWRITE] = ENABLE_CHK_OVERWRITE;
+    if (n_threads == 0)
+        return 0;
+
+    block_words = (geo.pages_per_block + 63) / 64;
+    written = (uint8_t *)calloc(geo.max_lba + 1, sizeof(uint8_t));
+    programmed = (uint64_t *)calloc((uint64_t)geo.num_blocks * block_words,
+            sizeof(uint64_t));
+    /* the rings keep head and tail on cache lines of their own */
+    if (posix_memalign((void **)&queues, 64,
+            n_threads * sizeof(chk_queue_t)) != 0)
+        queues = NULL;
+    if (written == NULL || programmed == NULL || queues == NULL) {
+        close_checker();
+        return 1;
+    }
+    memset(queues, 0, n_threads * sizeof(chk_queue_t));
+    stopping = failed = sim_parked = 0;
+    for (n_queues = 0; n_queues < n_threads; n_queues++) {
+        chk_queue_t *q = &queues[n_queues];
+        spsc_init(&q->q, CHK_QUEUE_SIZE);
+        q->buf = (uint32_t *)malloc(CHK_QUEUE_SIZE * sizeof(uint32_t));
+        if (q->buf == NULL ||
+                pthread_create(&q->thread, NULL, run_checker, q) != 0) {
+            free(q->buf);
+            close_checker();
+            return 1;
+        }
+    }
     return 0;
 }
 
+/* Wait for the checker threads to validate every queued event */
 void close_checker(void)
 {
+    /* the simulation is over, so a failing checker thread may dump */
+    __atomic_store_n(&sim_parked, 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    for (uint32_t i = 0; i < n_queues; i++) {
+        pthread_join(queues[i].thread, NULL);
+        free(queues[i].buf);
+    }
+    n_queues = 0;
+    free(queues);
+    queues = NULL;
+    free(written);
+    written = NULL;
+    free(programmed);
+    programmed = NULL;
 }
 
 void chk_lpn_consistent(vpage_t *pp, uint32_t lba, uint32_t sect, uint32_t n_sect, uint8_t *vers)
 {
-    /* TODO: this might degrade perfomance */
     if (!checkable[CHK_LPN_CONSISTENT])
         return;
 
-    for (uint32_t i = 0; i < n_sect; i++) {
-        if (vers[lba + i] && lba + i != pp->lbas[sect + i]) {
-            violation("LBA mismatched, issued LBA = %u, stored LBA = %u\n",
-                    lba + i, pp->lbas[sect + i]);
-            abort();
-        }
-    }
+    if (queues != NULL)
+        push_event(host_queue(lba), CHK_EV_READ, lba, 0, 0,
+                &pp->lbas[sect], n_sect);
+    else
+        check_lbas(last_seq(), vers, lba, &pp->lbas[sect], n_sect);
 }
 
-void chk_non_seq_write(flash_t *flashp, uint32_t bank, uint32_t blk, uint32_t page)
+void chk_host_write(uint32_t lba, uint32_t n_sect)
+{
+    /* the simulation keeps its own record for inline checks */
+    if (!checkable[CHK_LPN_CONSISTENT] || queues == NULL)
+        return;
+
+    push_event(host_queue(lba), CHK_EV_WRITE, lba, n_sect, 0, NULL, 0);
+}
+
+void chk_non_seq_write(uint32_t bank, uint32_t blk, uint32_t page)
 {
     if (!checkable[CHK_NON_SEQ_WRITE])
         return;
 
-    if (page == 0)
+    if (queues != NULL)
+        push_event(flash_queue(bank), CHK_EV_SEQ, bank, blk, page, NULL, 0);
+    else if (page != 0)
+        check_seq_write(last_seq(), bank, blk, page,
+                flash_is_erased(bank, blk, page - 1));
+}
+
+void chk_overwrite(uint32_t bank, uint32_t blk, uint32_t page)
+{
+    /* the shadow state follows every program of either flash check */
+    if (queues != NULL) {
+        if (checkable[CHK_NON_SEQ_WRITE] || checkable[CHK_OVERWRITE])
+            push_event(flash_queue(bank), CHK_EV_PROGRAM, bank, blk, page,
+                    NULL, 0);
         return;
-    flash_page_t *pp = &(flashp->banks[bank].blocks[blk].pages[page - 1]);
-    if (pp->is_erased) {
-        violation("Non-sequential write to bank #%u, blk #%u, page #%u\n",
-                bank, blk, page);
-        abort();
     }
+    if (!checkable[CHK_OVERWRITE])
+        return;
+
+    check_overwrite(last_seq(), bank, blk, page,
+            flash_is_erased(bank, blk, page));
 }
 
-void chk_overwrite(flash_t *flashp, uint32_t bank, uint32_t blk, uint32_t page)
+void chk_erase(uint32_t bank, uint32_t blk)
 {
-    if (!checkable[CHK_OVERWRITE])
+    if (queues == NULL ||
+            !(checkable[CHK_NON_SEQ_WRITE] || checkable[CHK_OVERWRITE]))
         return;
 
-    flash_page_t *pp = &(flashp->banks[bank].blocks[blk].pages[page]);
-    if (!pp->is_erased) {
-        violation("Directly overwrite to bank #%u , blk #%u, page#%u\n",
-                bank, blk, page);
-        abort();
-    }
+    push_event(flash_queue(bank), CHK_EV_ERASE, bank, blk, 0, NULL, 0);
 }
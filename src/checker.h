@@ -19,10 +19,12 @@
 #define ENABLE_CHK_NON_SEQ_WRITE 0
 #define ENABLE_CHK_OVERWRITE 1
 
-int open_checker(void);
+int open_checker(uint32_t n_threads);
 void close_checker(void);
 void chk_lpn_consistent(vpage_t *pp, uint32_t lba, uint32_t sect, uint32_t n_sect, uint8_t *vers);
-void chk_non_seq_write(flash_t *flashp, uint32_t bank, uint32_t blk, uint32_t page);
-void chk_overwrite(flash_t *flashp, uint32_t bank, uint32_t blk, uint32_t page);
+void chk_host_write(uint32_t lba, uint32_t n_sect);
+void chk_non_seq_write(uint32_t bank, uint32_t blk, uint32_t page);
+void chk_overwrite(uint32_t bank, uint32_t blk, uint32_t page);
+void chk_erase(uint32_t bank, uint32_t blk);
 
 #endif // CHECKER_H
@@ -0,0 +1,121 @@
+/**
+ * geometry.c
+ * Authors: Yun-Sheng Chang
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "config.h"
+#include "geometry.h"
+
+geometry_t geo;
+
+static int log2_exact(uint64_t n)
+{
+    int shift = 0;
+
+    if (n == 0 || (n & (n - 1)) != 0)
+        return -1;
+    while ((n >> shift) != 1)
+        shift++;
+    return shift;
+}
+
+/* The geometry the simulator is built with */
+void default_geometry(void)
+{
+    geo.num_banks = VST_NUM_BANKS;
+    geo.blocks_per_bank = VST_BLOCKS_PER_BANK;
+    geo.pages_per_block = VST_PAGES_PER_BLOCK;
+    geo.sectors_per_page = VST_SECTORS_PER_PAGE;
+    geo.bytes_per_sector = VST_BYTES_PER_SECTOR;
+    geo.max_lba = VST_MAX_LBA;
+}
+
+static int parse_param(char *kv)
+{
+    char *v, *end;
+    uint64_t n;
+
+    v = strchr(kv, '=');
+    if (v == NULL)
+        return 1;
+    *v++ = '\0';
+    n = strtoull(v, &end, 0);
+    if (*end != '\0' || n == 0)
+        return 1;
+    if (strcmp(kv, "lbas") == 0) {
+        geo.max_lba = n - 1;
+        return 0;
+    }
+    if (n > UINT32_MAX)
+        return 1;
+    if (strcmp(kv, "banks") == 0)
+        geo.num_banks = (uint32_t)n;
+    else if (strcmp(kv, "blocks") == 0)
+        geo.blocks_per_bank = (uint32_t)n;
+    else if (strcmp(kv, "pages") == 0)
+        geo.pages_per_block = (uint32_t)n;
+    else if (strcmp(kv, "sectors") == 0)
+        geo.sectors_per_page = (uint32_t)n;
+    else if (strcmp(kv, "sector_size") == 0)
+        geo.bytes_per_sector = (uint32_t)n;
+    else
+        return 1;
+    return 0;
+}
+
+/**
+ * Override the geometry with a spec such as "banks=16,lbas=200000000",
+ * giving the number of banks, blocks per bank, pages per block, sectors per
+ * page, sector size or number of LBAs
+ */
+int parse_geometry(const char *spec)
+{
+    char *s, *tok, *save;
+    int ret;
+
+    s = strdup(spec);
+    if (s == NULL)
+        return 1;
+    ret = 0;
+    for (tok = strtok_r(s, ",", &save); tok != NULL;
+            tok = strtok_r(NULL, ",", &save)) {
+        if (parse_param(tok)) {
+            fprintf(stderr, "Invalid geometry parameter %s.\n", tok);
+            ret = 1;
+            break;
+        }
+    }
+    free(s);
+    return ret;
+}
+
+/* Check the geometry and derive the remaining sizes */
+int open_geometry(void)
+{
+    if (geo.num_banks == 0 || geo.blocks_per_bank == 0 ||
+            geo.pages_per_block == 0 || geo.sectors_per_page == 0 ||
+            geo.sectors_per_page > VST_MAX_SECTORS_PER_PAGE ||
+            geo.bytes_per_sector == 0 || geo.bytes_per_sector % 8 != 0)
+        return 1;
+
+    geo.num_blocks = geo.num_banks * geo.blocks_per_bank;
+    geo.num_pages = (uint64_t)geo.num_blocks * geo.pages_per_block;
+    geo.num_sectors = geo.num_pages * geo.sectors_per_page;
+    geo.bytes_per_page = geo.sectors_per_page * geo.bytes_per_sector;
+    /* blocks and page buffers are indexed by 32 bits, LBAs are 32 bits */
+    if ((uint64_t)geo.num_banks * geo.blocks_per_bank > UINT32_MAX ||
+            geo.num_pages >= UINT32_MAX ||
+            geo.max_lba >= UINT32_MAX || geo.max_lba >= geo.num_sectors)
+        return 1;
+
+    geo.sect_shift = log2_exact(geo.sectors_per_page);
+    geo.byte_shift = log2_exact(geo.bytes_per_sector);
+    geo.page_shift = log2_exact(geo.bytes_per_page);
+    return 0;
+}
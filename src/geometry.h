@@ -0,0 +1,68 @@
+/**
+ * geometry.h
+ * Authors: Yun-Sheng Chang
+ */
+
+#ifndef GEOMETRY_H
+#define GEOMETRY_H
+
+#include <stdint.h>
+
+/* DRAM pages keep the LBAs of at most this many sectors */
+#define VST_MAX_SECTORS_PER_PAGE 32
+
+/**
+ * SSD geometry of a run.  It defaults to config.h, is taken from the FTL if
+ * the FTL exports vst_geometry_config(), and can be set on the command
+ * line.
+ */
+typedef struct {
+    uint32_t num_banks;
+    uint32_t blocks_per_bank;
+    uint32_t pages_per_block;
+    uint32_t sectors_per_page;
+    uint32_t bytes_per_sector;
+    uint64_t max_lba;
+
+    /* derived by open_geometry() */
+    uint32_t num_blocks;
+    uint64_t num_pages;
+    uint64_t num_sectors;
+    uint32_t bytes_per_page;
+    /* log2 of the sizes above, or -1 if not a power of two */
+    int sect_shift;
+    int byte_shift;
+    int page_shift;
+} geometry_t;
+
+extern geometry_t geo;
+
+/**
+ * Division and remainder by a size with the given shift, so that the
+ * common power-of-two geometries need no division
+ */
+static inline uint64_t geo_div(uint64_t x, uint32_t n, int shift)
+{
+    return (shift >= 0) ? x >> shift : x / n;
+}
+
+static inline uint64_t geo_mod(uint64_t x, uint32_t n, int shift)
+{
+    return (shift >= 0) ? x & (n - 1) : x % n;
+}
+
+/* LBA to sector in page */
+#define geo_sect(lba) \
+        ((uint32_t)geo_mod((lba), geo.sectors_per_page, geo.sect_shift))
+/* byte offset to page, and to sector in page */
+#define geo_page(off) \
+        geo_div((off), geo.bytes_per_page, geo.page_shift)
+#define geo_page_sect(off) \
+        ((uint32_t)geo_div(geo_mod((off), geo.bytes_per_page, \
+        geo.page_shift), geo.bytes_per_sector, geo.byte_shift))
+
+void default_geometry(void);
+int parse_geometry(const char *spec);
+int open_geometry(void);
+
+#endif // GEOMETRY_H
@@ -3,42 +3,212 @@
  * Authors: Yun-Sheng Chang
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <stdarg.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <inttypes.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/uio.h>
 #include "logger.h"
+#include "ring.h"
+
+/* events in the ring of each thread, a power of two */
+#define EV_RING_SIZE (1 << 16)
+/* most events the writer encodes into one block */
+#define EV_BLOCK_MAX 8192
+/* how long the writer sleeps when no ring holds a full block, in ns */
+#define EV_IDLE_NS 1000000
+
+/**
+ * Each thread that logs publishes its events into its own single-producer
+ * single-consumer ring.  A writer thread drains the rings, encodes the
+ * events compactly and writes them out a block at a time, so the logging
+ * thread never waits for I/O.  The writer takes full blocks as they come
+ * and the rest only after sleeping, so that it neither issues a write per
+ * handful of events nor pulls each cache line of the ring away from the
+ * logging thread while it is still being filled.  Rings are pushed onto a
+ * list on first use and freed at close.
+ */
+typedef struct ev_ring {
+    spsc_t q;
+    uint64_t dropped;
+    uint32_t tid;
+    struct ev_ring *next;
+    log_event_t ev[EV_RING_SIZE];
+} ev_ring_t;
 
 static FILE *fp_log;
-static int loggable[LOG_MAX];
+uint32_t event_mask;
+/* event types written to the event log */
+static uint32_t log_mask;
+__thread uint64_t event_seq;
+static int ev_fd = -1;
+static int ev_policy;
+static pthread_mutex_t ev_lock = PTHREAD_MUTEX_INITIALIZER;
+static ev_ring_t *ev_rings;
+static uint32_t n_ev_rings;
+static __thread ev_ring_t *my_ring;
+static pthread_t ev_writer;
+static int ev_writing, ev_stop;
+static uint8_t *ev_out;
+
+/**
+ * The flight recorder keeps the last events of the simulation thread in a
+ * ring of a power of two entries, overwritten without synchronization, so
+ * that a failing run can leave the events that led to the failure behind.
+ * The ring is dumped by dump_flight() from a violation or a fatal signal,
+ * so dumping only encodes into a buffer allocated up front and writes.
+ */
+static const int fr_signals[] = {
+    SIGABRT, SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGINT, SIGTERM
+};
+#define N_FR_SIGNALS (sizeof(fr_signals) / sizeof(fr_signals[0]))
+static log_event_t *fr_ev;
+static uint64_t fr_mask, fr_n;
+static uint8_t *fr_out;
+static char *fr_fname;
+static volatile sig_atomic_t fr_dumped;
+static struct sigaction fr_old[N_FR_SIGNALS];
+
+static const char *type_name[LOG_MISC + 1] = {
+    "general", "io", "flash", "ram", "misc"
+};
 
-int open_logger(char *fname)
+static void *run_writer(void *arg);
+
+static void init_hdr(struct ev_hdr *hdr)
+{
+    memset(hdr, 0, sizeof(*hdr));
+    memcpy(hdr->magic, EV_MAGIC, sizeof(hdr->magic));
+    hdr->version = EV_VERSION;
+    hdr->rec_size = sizeof(log_event_t);
+}
+
+/**
+ * Log text to fname and, if any event type is on, events to event_fname.
+ * Event types are those that are LOG_ON plus those of event_types that are
+ * built in.  With policy EV_DROP, events that find the ring of their
+ * thread full are dropped and counted instead of waiting for the writer.
+ */
+int open_logger(char *fname, char *event_fname, uint32_t event_types,
+                int policy)
 {
-    if (fname != NULL) {
+    int text = 0;
+
+    log_mask = 0;
+    for (int i = LOG_GENERAL; i <= LOG_MISC; i++) {
+        if (LOG_LEVEL(i) == LOG_ON)
+            text = 1;
+        if (i != LOG_GENERAL && (LOG_LEVEL(i) == LOG_ON ||
+                (LOG_LEVEL(i) == LOG_OPT && (event_types >> i & 1))))
+            log_mask |= 1u << i;
+    }
+    event_mask = log_mask;
+
+    /* no text log if no message can be logged */
+    if (fname != NULL && text) {
         fp_log = fopen(fname, "w");
         if (fp_log == NULL)
             return 1;
     }
+    if (log_mask == 0 || event_fname == NULL) {
+        event_mask = log_mask = 0;
+        return 0;
+    }
 
-    loggable[LOG_GENERAL] = ENABLE_LOG_GENERAL;
-    loggable[LOG_IO] = ENABLE_LOG_IO;
-    loggable[LOG_FLASH] = ENABLE_LOG_FLASH;
-    loggable[LOG_RAM] = ENABLE_LOG_RAM;
-    loggable[LOG_MISC] = ENABLE_LOG_MISC;
-    for (int i = LOG_MISC + 1; i < LOG_MAX; i++)
-        loggable[i] = 0;
-
+    struct ev_hdr hdr;
+    ev_fd = open(event_fname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (ev_fd < 0) {
+        event_mask = log_mask = 0;
+        return 1;
+    }
+    init_hdr(&hdr);
+    ev_policy = policy;
+    ev_stop = 0;
+    ev_out = (uint8_t *)malloc(EV_BLOCK_MAX * EV_MAX_ENC);
+    if (ev_out == NULL || write(ev_fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+            pthread_create(&ev_writer, NULL, run_writer, NULL) != 0) {
+        free(ev_out);
+        ev_out = NULL;
+        close(ev_fd);
+        ev_fd = -1;
+        event_mask = log_mask = 0;
+        return 1;
+    }
+    ev_writing = 1;
     return 0;
 }
 
 void close_logger(void)
 {
+    ev_ring_t *r, *next;
+    uint64_t dropped = 0;
+
+    /* events logged from here on are lost */
+    event_mask = log_mask = 0;
+    if (ev_writing) {
+        __atomic_store_n(&ev_stop, 1, __ATOMIC_RELEASE);
+        pthread_join(ev_writer, NULL);
+        ev_writing = 0;
+    }
+    pthread_mutex_lock(&ev_lock);
+    for (r = ev_rings; r != NULL; r = next) {
+        next = r->next;
+        dropped += r->dropped;
+        free(r);
+    }
+    ev_rings = NULL;
+    my_ring = NULL;
+    pthread_mutex_unlock(&ev_lock);
+    if (dropped > 0)
+        fprintf(stderr, "Event log: %" PRIu64 " events dropped.\n", dropped);
+    if (ev_fd >= 0)
+        close(ev_fd);
+    ev_fd = -1;
+    free(ev_out);
+    ev_out = NULL;
+
     if (fp_log != NULL)
         fclose(fp_log);
+    fp_log = NULL;
+}
+
+/* Turn a list of types such as "flash,io" into a mask */
+int parse_log_types(const char *spec, uint32_t *mask)
+{
+    const char *p = spec;
+    size_t len;
+    int i;
+
+    *mask = 0;
+    while (*p != '\0') {
+        len = strcspn(p, ",");
+        for (i = 0; i <= LOG_MISC; i++) {
+            if (strlen(type_name[i]) == len &&
+                    strncmp(p, type_name[i], len) == 0)
+                break;
+        }
+        if (i > LOG_MISC)
+            return 1;
+        *mask |= 1u << i;
+        p += len;
+        if (*p == ',')
+            p++;
+    }
+    return 0;
 }
 
-void __attribute__((format(printf, 2, 3))) record(int type, const char *fmt, ...)
+void __attribute__((format(printf, 2, 3))) put_record(int type, const char *fmt, ...)
 {
-    /* TODO: this degrades performance by ~4% */
-    if (!fp_log || !loggable[type])
+    if (!fp_log)
         return;
 
     switch (type) {
@@ -59,8 +229,351 @@ void __attribute__((format(printf, 2, 3))) record(int type, const char *fmt, ...
         break;
     }
 
-    va_list ap; 
+    va_list ap;
     va_start(ap, fmt);
     vfprintf(fp_log, fmt, ap);
     va_end(ap);
 }
+
+static inline uint8_t *put_varint(uint8_t *p, uint64_t v)
+{
+    while (v >= 0x80) {
+        *p++ = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (uint8_t)v;
+    return p;
+}
+
+static inline uint64_t zigzag(int64_t v)
+{
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int get_varint(const uint8_t **pp, const uint8_t *end,
+                             uint64_t *v)
+{
+    const uint8_t *p = *pp;
+    int shift = 0;
+
+    *v = 0;
+    do {
+        if (p == end || shift >= 64)
+            return 1;
+        *v |= (uint64_t)(*p & 0x7f) << shift;
+        shift += 7;
+    } while (*p++ & 0x80);
+    *pp = p;
+    return 0;
+}
+
+static inline uint64_t unzigzag(uint64_t v)
+{
+    return (v >> 1) ^ -(v & 1);
+}
+
+/**
+ * Encode an event as its op and varint differences from the previous event
+ * of its block, which it then replaces.  Consecutive flash events mostly
+ * differ in a few fields by small amounts, so they take about a third of
+ * their size.
+ */
+uint8_t *ev_encode(uint8_t *p, const log_event_t *ev, log_event_t *prev)
+{
+    *p++ = ev->op;
+    p = put_varint(p, ev->seq - prev->seq - 1);
+    p = put_varint(p, zigzag((int64_t)ev->bank - prev->bank));
+    p = put_varint(p, zigzag((int64_t)ev->blk - prev->blk));
+    p = put_varint(p, zigzag((int64_t)ev->page - prev->page));
+    p = put_varint(p, ev->sect);
+    p = put_varint(p, ev->n);
+    p = put_varint(p, zigzag((int64_t)(ev->addr - prev->addr)));
+    *prev = *ev;
+    return p;
+}
+
+/* Decode an event encoded by ev_encode(); 1 if it does not end by end */
+int ev_decode(const uint8_t **pp, const uint8_t *end, log_event_t *ev,
+              log_event_t *prev)
+{
+    const uint8_t *p = *pp;
+    uint64_t v[7];
+
+    if (p == end)
+        return 1;
+    ev->op = *p++;
+    for (int i = 0; i < 7; i++) {
+        if (get_varint(&p, end, &v[i]))
+            return 1;
+    }
+    ev->seq = prev->seq + v[0] + 1;
+    ev->bank = (uint16_t)(prev->bank + unzigzag(v[1]));
+    ev->blk = (uint32_t)(prev->blk + unzigzag(v[2]));
+    ev->page = (uint32_t)(prev->page + unzigzag(v[3]));
+    ev->sect = (uint8_t)v[4];
+    ev->n = (uint32_t)v[5];
+    ev->addr = prev->addr + unzigzag(v[6]);
+    *prev = *ev;
+    *pp = p;
+    return 0;
+}
+
+/**
+ * Encode and write out a block of the events of a ring from tail on, only
+ * if it is full unless partial is set
+ */
+static int drain_ring(ev_ring_t *r, int partial)
+{
+    struct ev_block blk;
+    struct iovec iov[2];
+    log_event_t prev;
+    uint64_t tail, n;
+    uint8_t *p;
+
+    n = spsc_avail(&r->q);
+    if (n == 0 || (n < EV_BLOCK_MAX && !partial))
+        return 0;
+    if (n > EV_BLOCK_MAX)
+        n = EV_BLOCK_MAX;
+    /* the first event of a block is relative to a zero event */
+    memset(&prev, 0, sizeof(prev));
+    prev.seq = UINT64_MAX;
+    p = ev_out;
+    tail = r->q.tail;
+    for (uint64_t i = 0; i < n; i++)
+        p = ev_encode(p, &r->ev[spsc_idx(&r->q, tail + i)], &prev);
+    /* the events are copied out, so the producer may reuse the slots */
+    spsc_release(&r->q, n);
+
+    blk.tid = r->tid;
+    blk.n_rec = (uint32_t)n;
+    blk.n_byte = (uint32_t)(p - ev_out);
+    blk.reserved = 0;
+    iov[0].iov_base = &blk;
+    iov[0].iov_len = sizeof(blk);
+    iov[1].iov_base = ev_out;
+    iov[1].iov_len = blk.n_byte;
+    if (writev(ev_fd, iov, 2) != (ssize_t)(sizeof(blk) + blk.n_byte) &&
+            log_mask != 0) {
+        fprintf(stderr, "Fail writing event log, logging stopped.\n");
+        log_mask = 0;
+    }
+    return 1;
+}
+
+static void *run_writer(void *arg)
+{
+    struct timespec idle = {0, EV_IDLE_NS};
+    ev_ring_t *r;
+    int busy, stop, partial = 0;
+
+    (void)arg;
+    for (;;) {
+        /* the rings are drained once more after the stop request */
+        stop = __atomic_load_n(&ev_stop, __ATOMIC_ACQUIRE);
+        busy = 0;
+        for (r = __atomic_load_n(&ev_rings, __ATOMIC_ACQUIRE); r != NULL;
+                r = r->next)
+            busy |= drain_ring(r, partial || stop);
+        if (stop && !busy)
+            break;
+        /* after a sleep, partial blocks are written out too */
+        partial = !busy;
+        if (!busy)
+            nanosleep(&idle, NULL);
+    }
+    return NULL;
+}
+
+static ev_ring_t *new_ring(void)
+{
+    ev_ring_t *r;
+
+    if (posix_memalign((void **)&r, 64, sizeof(ev_ring_t)) != 0) {
+        fprintf(stderr, "Fail allocating event ring, logging stopped.\n");
+        log_mask = 0;
+        return NULL;
+    }
+    memset(r, 0, sizeof(*r));
+    spsc_init(&r->q, EV_RING_SIZE);
+    pthread_mutex_lock(&ev_lock);
+    r->tid = n_ev_rings++;
+    r->next = ev_rings;
+    /* the writer walks the list without the lock */
+    __atomic_store_n(&ev_rings, r, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&ev_lock);
+    return r;
+}
+
+/* What a thread does while the writer has not freed a slot of its ring */
+static int wait_writer(void)
+{
+    if (ev_policy == EV_DROP)
+        return 1;
+    sched_yield();
+    return 0;
+}
+
+/* Publish an event to the ring of this thread for the writer */
+static void log_event(const log_event_t *ev)
+{
+    ev_ring_t *r = my_ring;
+
+    if (r == NULL) {
+        r = my_ring = new_ring();
+        if (r == NULL)
+            return;
+    }
+    if (spsc_reserve(&r->q, 1, wait_writer)) {
+        /* the gap in sequence numbers shows where */
+        r->dropped++;
+        return;
+    }
+    r->ev[spsc_idx(&r->q, r->q.head)] = *ev;
+    spsc_publish(&r->q, 1);
+}
+
+void put_event(uint8_t op, uint32_t bank, uint32_t blk, uint32_t page,
+               uint32_t sect, uint32_t n, uint64_t addr)
+{
+    log_event_t ev;
+
+    ev.seq = event_seq++;
+    ev.addr = addr;
+    ev.blk = blk;
+    ev.page = page;
+    ev.n = n;
+    ev.bank = (uint16_t)bank;
+    ev.sect = (uint8_t)sect;
+    ev.op = op;
+    if (fr_ev != NULL)
+        fr_ev[fr_n++ & fr_mask] = ev;
+    if ((log_mask >> EV_TYPE(op)) & 1)
+        log_event(&ev);
+}
+
+int flight_on(void)
+{
+    return fr_ev != NULL;
+}
+
+/**
+ * Whether the event of sequence number seq is still in the flight recorder;
+ * only the simulation thread logs events, so its numbers count them all
+ */
+int flight_holds(uint64_t seq)
+{
+    return fr_ev != NULL && seq < fr_n && fr_n - seq <= fr_mask + 1;
+}
+
+/**
+ * Write the events in the flight recorder, oldest first, to the file given
+ * to open_flight() as an event log; only the first call writes.  Safe to
+ * call from a signal handler.
+ */
+void dump_flight(void)
+{
+    struct ev_hdr hdr;
+    struct ev_block blk;
+    log_event_t prev;
+    uint64_t first, last, i, n;
+    uint8_t *p;
+    ssize_t rc;
+    int fd;
+
+    if (fr_ev == NULL || fr_dumped)
+        return;
+    fr_dumped = 1;
+    fd = open(fr_fname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return;
+    init_hdr(&hdr);
+    if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+        close(fd);
+        return;
+    }
+    last = fr_n;
+    first = last > fr_mask + 1 ? last - (fr_mask + 1) : 0;
+    for (i = first; i < last; i += n) {
+        n = last - i < EV_BLOCK_MAX ? last - i : EV_BLOCK_MAX;
+        memset(&prev, 0, sizeof(prev));
+        prev.seq = UINT64_MAX;
+        p = fr_out;
+        for (uint64_t j = 0; j < n; j++)
+            p = ev_encode(p, &fr_ev[(i + j) & fr_mask], &prev);
+        blk.tid = 0;
+        blk.n_rec = (uint32_t)n;
+        blk.n_byte = (uint32_t)(p - fr_out);
+        blk.reserved = 0;
+        if (write(fd, &blk, sizeof(blk)) != sizeof(blk) ||
+                write(fd, fr_out, blk.n_byte) != (ssize_t)blk.n_byte)
+            break;
+    }
+    close(fd);
+    rc = write(STDERR_FILENO, "Last events dumped to ", 22);
+    rc = write(STDERR_FILENO, fr_fname, strlen(fr_fname));
+    rc = write(STDERR_FILENO, "\n", 1);
+    (void)rc;
+}
+
+static void on_fatal_signal(int sig)
+{
+    dump_flight();
+    /* die of the signal as if it was not caught */
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+/**
+ * Keep the last n_event events, rounded up to a power of two, of every
+ * built-in type, and dump them to fname on a violation or a fatal signal;
+ * the recorder stays off if n_event is 0.  Must follow open_logger().
+ */
+int open_flight(char *fname, uint64_t n_event)
+{
+    struct sigaction sa;
+    uint64_t size = 1;
+
+    if (n_event == 0 || (LOG_BUILT & ~(1u << LOG_GENERAL)) == 0)
+        return 0;
+    while (size < n_event)
+        size <<= 1;
+    fr_ev = (log_event_t *)malloc(size * sizeof(log_event_t));
+    fr_out = (uint8_t *)malloc(EV_BLOCK_MAX * EV_MAX_ENC);
+    fr_fname = strdup(fname);
+    if (fr_ev == NULL || fr_out == NULL || fr_fname == NULL) {
+        free(fr_ev);
+        fr_ev = NULL;
+        free(fr_out);
+        fr_out = NULL;
+        free(fr_fname);
+        fr_fname = NULL;
+        return 1;
+    }
+    fr_mask = size - 1;
+    fr_n = 0;
+    fr_dumped = 0;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_fatal_signal;
+    sigemptyset(&sa.sa_mask);
+    for (size_t i = 0; i < N_FR_SIGNALS; i++)
+        sigaction(fr_signals[i], &sa, &fr_old[i]);
+    event_mask |= LOG_BUILT & ~(1u << LOG_GENERAL);
+    return 0;
+}
+
+void close_flight(void)
+{
+    if (fr_ev == NULL)
+        return;
+    for (size_t i = 0; i < N_FR_SIGNALS; i++)
+        sigaction(fr_signals[i], &fr_old[i], NULL);
+    event_mask = log_mask;
+    free(fr_ev);
+    fr_ev = NULL;
+    free(fr_out);
+    fr_out = NULL;
+    free(fr_fname);
+    fr_fname = NULL;
+}
@@ -6,6 +6,8 @@
 #ifndef LOGGER_H
 #define LOGGER_H
 
+#include <stdint.h>
+
 #define LOG_GENERAL 0
 #define LOG_IO 1
 #define LOG_FLASH 2
@@ -13,14 +15,159 @@
 #define LOG_MISC 4
 #define LOG_MAX 10
 
-#define ENABLE_LOG_GENERAL 1
-#define ENABLE_LOG_IO 0
-#define ENABLE_LOG_FLASH 0
-#define ENABLE_LOG_RAM 0
-#define ENABLE_LOG_MISC 0
+/**
+ * What is built in for each log type; override with -DENABLE_LOG_xxx=n.
+ *   LOG_OFF: calls compile to nothing, -l cannot turn the type on
+ *   LOG_OPT: events are logged if -l turns the type on
+ *   LOG_ON: messages and events are always logged
+ */
+#define LOG_OFF 0
+#define LOG_OPT 1
+#define LOG_ON 2
+
+#ifndef ENABLE_LOG_GENERAL
+#define ENABLE_LOG_GENERAL LOG_ON
+#endif
+#ifndef ENABLE_LOG_IO
+#define ENABLE_LOG_IO LOG_OPT
+#endif
+#ifndef ENABLE_LOG_FLASH
+#define ENABLE_LOG_FLASH LOG_OPT
+#endif
+#ifndef ENABLE_LOG_RAM
+#define ENABLE_LOG_RAM LOG_OPT
+#endif
+#ifndef ENABLE_LOG_MISC
+#define ENABLE_LOG_MISC LOG_OPT
+#endif
+
+/* a constant for a constant type */
+#define LOG_LEVEL(type) \
+    ((type) == LOG_GENERAL ? ENABLE_LOG_GENERAL : \
+     (type) == LOG_IO ? ENABLE_LOG_IO : \
+     (type) == LOG_FLASH ? ENABLE_LOG_FLASH : \
+     (type) == LOG_RAM ? ENABLE_LOG_RAM : \
+     (type) == LOG_MISC ? ENABLE_LOG_MISC : LOG_OFF)
+
+/* types built in at all, one bit per type */
+#define LOG_BUILT \
+    ((ENABLE_LOG_GENERAL != LOG_OFF) << LOG_GENERAL | \
+     (ENABLE_LOG_IO != LOG_OFF) << LOG_IO | \
+     (ENABLE_LOG_FLASH != LOG_OFF) << LOG_FLASH | \
+     (ENABLE_LOG_RAM != LOG_OFF) << LOG_RAM | \
+     (ENABLE_LOG_MISC != LOG_OFF) << LOG_MISC)
+
+/* events of each type; the type is the high nibble of log_event_t.op */
+#define EV_OP(type, code) ((uint8_t)((type) << 4 | (code)))
+#define EV_TYPE(op) ((op) >> 4)
+#define EV_IO_READ EV_OP(LOG_IO, 0)
+#define EV_IO_WRITE EV_OP(LOG_IO, 1)
+#define EV_FLASH_READ EV_OP(LOG_FLASH, 0)
+#define EV_FLASH_WRITE EV_OP(LOG_FLASH, 1)
+#define EV_FLASH_COPYBACK EV_OP(LOG_FLASH, 2)
+#define EV_FLASH_ERASE EV_OP(LOG_FLASH, 3)
+#define EV_RAM_MEMCPY EV_OP(LOG_RAM, 0)
+#define EV_RAM_MEMSET EV_OP(LOG_RAM, 1)
+#define EV_RAM_TAGGED_COPY EV_OP(LOG_RAM, 2)
+#define EV_RAM_TAGGED_SECT EV_OP(LOG_RAM, 3)
+#define EV_RAM_TAGGED_TO_SRAM EV_OP(LOG_RAM, 4)
+
+/**
+ * Binary event record.  Fields not listed for an event are zero.
+ *   IO read/write: blk = LBA, n = sectors
+ *   flash read/write: bank, blk, page, sect, n = sectors, addr = DRAM
+ *   flash copyback: bank, blk and page of the source, addr = destination
+ *     block << 32 | destination page
+ *   flash erase: bank, blk
+ *   memcpy, tagged copy and tagged to SRAM: addr = source, blk and page =
+ *     low and high halves of the destination, n = bytes
+ *   memset: addr, n = bytes, blk = value
+ *   tagged sector: addr = destination page, sect = its sector, page =
+ *     source sector, blk = LBA
+ */
+typedef struct {
+    uint64_t seq;
+    uint64_t addr;
+    uint32_t blk;
+    uint32_t page;
+    uint32_t n;
+    uint16_t bank;
+    uint8_t sect;
+    uint8_t op;
+} log_event_t;
+
+/**
+ * An event log starts with a header and continues with blocks of events,
+ * each of one thread, numbered in the order threads first logged.  The
+ * n_rec events of a block take n_byte bytes, each encoded by ev_encode()
+ * relative to the one before it in the block.
+ */
+#define EV_MAGIC "VSTEVLOG"
+#define EV_VERSION 2
+
+struct ev_hdr {
+    char magic[8];
+    uint32_t version;
+    uint32_t rec_size;
+};
+
+struct ev_block {
+    uint32_t tid;
+    uint32_t n_rec;
+    uint32_t n_byte;
+    uint32_t reserved;
+};
+
+/* longest encoding of an event */
+#define EV_MAX_ENC 48
+
+/* what a thread does when its event ring is full */
+#define EV_BLOCK 0
+#define EV_DROP 1
+
+/* event types enabled, one bit per type */
+extern uint32_t event_mask;
+/* sequence number of the next event of this thread */
+extern __thread uint64_t event_seq;
 
-int open_logger(char *fname);
+int open_logger(char *fname, char *event_fname, uint32_t event_types,
+                int policy);
 void close_logger(void);
-void __attribute__((format(printf, 2, 3))) record(int type, const char *fmt, ...);
+int open_flight(char *fname, uint64_t n_event);
+void close_flight(void);
+void dump_flight(void);
+int flight_on(void);
+int flight_holds(uint64_t seq);
+int parse_log_types(const char *spec, uint32_t *mask);
+uint8_t *ev_encode(uint8_t *p, const log_event_t *ev, log_event_t *prev);
+int ev_decode(const uint8_t **pp, const uint8_t *end, log_event_t *ev,
+              log_event_t *prev);
+void __attribute__((format(printf, 2, 3))) put_record(int type, const char *fmt, ...);
+void put_event(uint8_t op, uint32_t bank, uint32_t blk, uint32_t page,
+               uint32_t sect, uint32_t n, uint64_t addr);
+
+/**
+ * Log a message of a type that is LOG_ON.  Otherwise the call, including
+ * the evaluation of its arguments, is compiled out.
+ */
+#define record(type, ...) \
+    do { \
+        if (LOG_LEVEL(type) == LOG_ON) \
+            put_record(type, __VA_ARGS__); \
+    } while (0)
+
+/**
+ * Log an event; costs only a test of event_mask unless its type is logged
+ * or the flight recorder is on, and nothing if its type is LOG_OFF
+ */
+static inline __attribute__((always_inline)) void record_event(
+        uint8_t op, uint32_t bank, uint32_t blk, uint32_t page, uint32_t sect,
+        uint32_t n, uint64_t addr)
+{
+    if (LOG_LEVEL(EV_TYPE(op)) == LOG_OFF)
+        return;
+    if (__builtin_expect((event_mask >> EV_TYPE(op)) & 1, 0))
+        put_event(op, bank, blk, page, sect, n, addr);
+}
 
 #endif // LOGGER_H
@@ -0,0 +1,138 @@
+/**
+ * progress.c
+ * Authors: Yun-Sheng Chang
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include "geometry.h"
+#include "stat.h"
+#include "progress.h"
+
+/**
+ * A reporter thread wakes up every interval seconds, samples the counters
+ * of the stat module and prints a progress line to stderr.  Rates are over
+ * the last interval; the ETA is to the write bound at the average write
+ * rate so far.  The simulation thread only pays for the relaxed updates of
+ * the counters.
+ */
+static pthread_t thread;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond;
+static int running, stopping;
+static double period;
+static uint64_t write_bound;
+
+static double now_s(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void print_eta(double s)
+{
+    uint64_t t = (uint64_t)s;
+
+    fprintf(stderr, ", ETA %lluh%02llum%02llus",
+            (unsigned long long)(t / 3600),
+            (unsigned long long)(t / 60 % 60), (unsigned long long)(t % 60));
+}
+
+static void report(double elapsed, double dt, const stat_progress_t *cur,
+                   const stat_progress_t *last)
+{
+    uint64_t host = cur->host_sect - last->host_sect;
+    uint64_t flash = (cur->flash_read + cur->flash_prog + cur->flash_erase) -
+            (last->flash_read + last->flash_prog + last->flash_erase);
+
+    fprintf(stderr, "[%.0fs] %.2f GB written", elapsed,
+            cur->byte_write / 1073741824.0);
+    if (write_bound > 1)
+        fprintf(stderr, " (%.1f%%)", 100.0 * cur->byte_write / write_bound);
+    fprintf(stderr, ", %.0f req/s, %.0f flash op/s",
+            (cur->requests - last->requests) / dt, flash / dt);
+    if (host != 0)
+        fprintf(stderr, ", WAF %.2f", (double)(cur->flash_prog -
+                last->flash_prog) * geo.sectors_per_page / host);
+    if (write_bound > cur->byte_write && cur->byte_write > 0)
+        print_eta((write_bound - cur->byte_write) * elapsed /
+                cur->byte_write);
+    fputc('\n', stderr);
+}
+
+static void *run_progress(void *arg)
+{
+    stat_progress_t cur, last = {0};
+    struct timespec until;
+    double start, t, t_last;
+
+    (void)arg;
+    start = now_s();
+    t_last = start;
+    clock_gettime(CLOCK_MONOTONIC, &until);
+    pthread_mutex_lock(&lock);
+    while (!stopping) {
+        until.tv_sec += (time_t)period;
+        until.tv_nsec += (long)((period - (time_t)period) * 1e9);
+        if (until.tv_nsec >= 1000000000) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000;
+        }
+        while (!stopping &&
+                pthread_cond_timedwait(&cond, &lock, &until) == 0)
+            ;
+        if (stopping)
+            break;
+        get_progress(&cur);
+        t = now_s();
+        report(t - start, t - t_last, &cur, &last);
+        last = cur;
+        t_last = t;
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+/**
+ * Report progress every interval seconds of a run that stops after bound
+ * bytes of host writes
+ */
+int open_progress(double interval, uint64_t bound)
+{
+    pthread_condattr_t attr;
+
+    if (interval <= 0)
+        return 1;
+    period = interval;
+    write_bound = bound;
+    stopping = 0;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&cond, &attr);
+    pthread_condattr_destroy(&attr);
+    if (pthread_create(&thread, NULL, run_progress, NULL) != 0) {
+        pthread_cond_destroy(&cond);
+        return 1;
+    }
+    running = 1;
+    return 0;
+}
+
+void close_progress(void)
+{
+    if (!running)
+        return;
+    pthread_mutex_lock(&lock);
+    stopping = 1;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&lock);
+    pthread_join(thread, NULL);
+    pthread_cond_destroy(&cond);
+    running = 0;
+}
@@ -0,0 +1,14 @@
+/**
+ * progress.h
+ * Authors: Yun-Sheng Chang
+ */
+
+#ifndef PROGRESS_H
+#define PROGRESS_H
+
+#include <stdint.h>
+
+int open_progress(double interval, uint64_t bound);
+void close_progress(void);
+
+#endif // PROGRESS_H
@@ -0,0 +1,170 @@
+/**
+ * results.c
+ * Authors: Yun-Sheng Chang
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <inttypes.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "results.h"
+
+#define RES_MAX_DEPTH 8
+
+/**
+ * The results of a run are appended to the results file as one JSON object
+ * on a single line.  Modules add their fields as they close; the line is
+ * built in memory and written with one append, so concurrent runs can share
+ * a results file.  Without a results file all calls do nothing.
+ */
+static int res_fd = -1;
+static char *buf;
+static size_t len, cap;
+static int depth;
+static int has_field[RES_MAX_DEPTH];
+
+static void put(const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    for (;;) {
+        va_start(ap, fmt);
+        n = vsnprintf(buf + len, cap - len, fmt, ap);
+        va_end(ap);
+        if (n < 0)
+            return;
+        if (len + n < cap)
+            break;
+        char *p = (char *)realloc(buf, 2 * (len + n + 1));
+        if (p == NULL)
+            return;
+        buf = p;
+        cap = 2 * (len + n + 1);
+    }
+    len += n;
+}
+
+static void put_quoted(const char *s)
+{
+    put("\"");
+    for (; *s != '\0'; s++) {
+        if (*s == '"' || *s == '\\')
+            put("\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            put("\\u%04x", (unsigned char)*s);
+        else
+            put("%c", *s);
+    }
+    put("\"");
+}
+
+static void put_key(const char *key)
+{
+    if (has_field[depth])
+        put(",");
+    has_field[depth] = 1;
+    put_quoted(key);
+    put(":");
+}
+
+int open_results(const char *path)
+{
+    if (path == NULL)
+        return 0;
+    res_fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (res_fd < 0)
+        return 1;
+    cap = 4096;
+    buf = (char *)malloc(cap);
+    if (buf == NULL) {
+        close(res_fd);
+        res_fd = -1;
+        return 1;
+    }
+    len = 0;
+    depth = 0;
+    has_field[0] = 0;
+    put("{");
+    res_u64("schema", RES_SCHEMA);
+    return 0;
+}
+
+void close_results(void)
+{
+    if (res_fd < 0)
+        return;
+    while (depth > 0)
+        res_end();
+    put("}\n");
+    if (write(res_fd, buf, len) != (ssize_t)len)
+        fprintf(stderr, "Fail writing results.\n");
+    close(res_fd);
+    res_fd = -1;
+    free(buf);
+    buf = NULL;
+}
+
+/* Start a nested object */
+void res_begin(const char *key)
+{
+    if (res_fd < 0 || depth + 1 >= RES_MAX_DEPTH)
+        return;
+    put_key(key);
+    put("{");
+    has_field[++depth] = 0;
+}
+
+void res_end(void)
+{
+    if (res_fd < 0 || depth == 0)
+        return;
+    put("}");
+    depth--;
+}
+
+void res_str(const char *key, const char *val)
+{
+    if (res_fd < 0)
+        return;
+    put_key(key);
+    if (val != NULL)
+        put_quoted(val);
+    else
+        put("null");
+}
+
+void res_u64(const char *key, uint64_t val)
+{
+    if (res_fd < 0)
+        return;
+    put_key(key);
+    put("%" PRIu64, val);
+}
+
+/* JSON has no NaN or infinity; they become null */
+void res_dbl(const char *key, double val)
+{
+    if (res_fd < 0)
+        return;
+    put_key(key);
+    if (isfinite(val))
+        put("%.10g", val);
+    else
+        put("null");
+}
+
+void res_bool(const char *key, int val)
+{
+    if (res_fd < 0)
+        return;
+    put_key(key);
+    put(val ? "true" : "false");
+}
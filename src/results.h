@@ -0,0 +1,23 @@
+/**
+ * results.h
+ * Authors: Yun-Sheng Chang
+ */
+
+#ifndef RESULTS_H
+#define RESULTS_H
+
+#include <stdint.h>
+
+/* bump when fields are renamed or change meaning */
+#define RES_SCHEMA 1
+
+int open_results(const char *path);
+void close_results(void);
+void res_begin(const char *key);
+void res_end(void);
+void res_str(const char *key, const char *val);
+void res_u64(const char *key, uint64_t val);
+void res_dbl(const char *key, double val);
+void res_bool(const char *key, int val);
+
+#endif // RESULTS_H
@@ -0,0 +1,72 @@
+/**
+ * ring.h
+ * Authors: Yun-Sheng Chang
+ */
+
+#ifndef RING_H
+#define RING_H
+
+#include <stdint.h>
+
+/**
+ * Single-producer single-consumer ring of a power of two slots, which the
+ * user keeps and indexes by spsc_idx() of a position.  head is written only
+ * by the producer and tail only by the consumer, each on a cache line of
+ * its own; the producer keeps a stale copy of tail and rereads tail only
+ * when the ring looks full.
+ */
+typedef struct {
+    uint64_t mask;
+    uint64_t head __attribute__((aligned(64)));
+    uint64_t tail_cache;
+    uint64_t tail __attribute__((aligned(64)));
+} spsc_t;
+
+static inline void spsc_init(spsc_t *r, uint64_t size)
+{
+    r->mask = size - 1;
+    r->head = 0;
+    r->tail_cache = 0;
+    r->tail = 0;
+}
+
+static inline uint64_t spsc_idx(const spsc_t *r, uint64_t pos)
+{
+    return pos & r->mask;
+}
+
+/**
+ * Wait for n free slots from head on, calling wait() each time the ring is
+ * still full; returns 1 if wait() gives up by returning nonzero
+ */
+static inline int spsc_reserve(spsc_t *r, uint64_t n, int (*wait)(void))
+{
+    while (r->head + n - r->tail_cache > r->mask + 1) {
+        r->tail_cache = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        if (r->head + n - r->tail_cache <= r->mask + 1)
+            break;
+        if (wait())
+            return 1;
+    }
+    return 0;
+}
+
+/* Hand the n slots from head on, now filled, to the consumer */
+static inline void spsc_publish(spsc_t *r, uint64_t n)
+{
+    __atomic_store_n(&r->head, r->head + n, __ATOMIC_RELEASE);
+}
+
+/* Number of filled slots from tail on */
+static inline uint64_t spsc_avail(spsc_t *r)
+{
+    return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) - r->tail;
+}
+
+/* Hand the n slots from tail on, now copied out, back to the producer */
+static inline void spsc_release(spsc_t *r, uint64_t n)
+{
+    __atomic_store_n(&r->tail, r->tail + n, __ATOMIC_RELEASE);
+}
+
+#endif // RING_H
@@ -4,40 +4,132 @@
  */
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <inttypes.h>
+#include <math.h>
+#include "geometry.h"
+#include "stat.h"
+#include "results.h"
+
+/**
+ * Request latencies go into log-linear histograms in the style of
+ * HdrHistogram: values below 2^HIST_SUB_BITS ns are counted exactly, and
+ * each larger power of two is split into 2^(HIST_SUB_BITS - 1) linear
+ * buckets, so every bucket is within 1/32 of the values it holds.  There
+ * is one histogram per direction and request size class.
+ */
+#define HIST_SUB_BITS 6
+#define HIST_HALF (1 << (HIST_SUB_BITS - 1))
+#define HIST_SIZE ((64 - HIST_SUB_BITS + 2) * HIST_HALF)
+
+/* request size classes, by upper bound in bytes */
+#define N_SIZE_CLASS 4
+static const uint64_t size_class_max[N_SIZE_CLASS] = {
+    4096, 16384, 65536, UINT64_MAX
+};
+static const char *size_class_name[N_SIZE_CLASS] = {
+    "<=4K", "<=16K", "<=64K", ">64K"
+};
+static const char *size_class_key[N_SIZE_CLASS] = {
+    "le4k", "le16k", "le64k", "gt64k"
+};
+
+/**
+ * Flash operations of a bank.  Pages programmed by writes and copybacks
+ * are split by what they hold; the write amplification of a bank is the
+ * number of pages it programmed per page worth of host sectors in them.
+ */
+typedef struct {
+    uint64_t read;
+    uint64_t write;
+    uint64_t cb;
+    uint64_t erase;
+    uint64_t prog[3];
+    uint64_t host_sect;
+} bank_stat_t;
+
+/* erase count distribution of a range of blocks */
+typedef struct {
+    uint32_t min;
+    uint32_t max;
+    double mean;
+    double sd;
+} erase_dist_t;
 
 extern int pass;
+/* counters read by the progress thread; see add_relaxed() */
 static uint64_t byte_read, byte_write;
 static uint64_t cnt_flash_read, cnt_flash_write, cnt_flash_cb, cnt_flash_erase;
+static uint64_t cnt_host_sect, cnt_req;
+static uint64_t hist[2][N_SIZE_CLASS][HIST_SIZE];
+static const char *lat_clock;
+static bank_stat_t *banks;
+static uint32_t *blk_erase;
+
+/**
+ * Time series: a CSV row every series_step bytes of host writes.  prev
+ * holds the programmed pages and host sectors of each bank at the last row,
+ * with the totals last, for the write amplification within the interval.
+ */
+static FILE *series_fp;
+static uint64_t series_step, series_next, series_last;
+static uint64_t *series_prev;
+
+static void sample_series(void);
+
+/**
+ * Only the simulation thread updates the counters, so a relaxed load and
+ * store make the update visible to other threads without the cost of an
+ * atomic read-modify-write
+ */
+static inline void add_relaxed(uint64_t *cnt, uint64_t n)
+{
+    __atomic_store_n(cnt, __atomic_load_n(cnt, __ATOMIC_RELAXED) + n,
+            __ATOMIC_RELAXED);
+}
 
 void inc_byte_read(uint64_t n_byte)
 {
-    byte_read += n_byte;
+    add_relaxed(&byte_read, n_byte);
 }
 
 void inc_byte_write(uint64_t n_byte)
 {
-    byte_write += n_byte;
+    add_relaxed(&byte_write, n_byte);
+    if (series_fp != NULL && byte_write >= series_next)
+        sample_series();
 }
 
-void inc_flash_read(uint64_t n_page)
+void inc_flash_read(uint32_t bank)
 {
-    cnt_flash_read += n_page;
+    add_relaxed(&cnt_flash_read, 1);
+    banks[bank].read++;
 }
 
-void inc_flash_write(uint64_t n_page)
+/* A page of the given kind holding n_host new host sectors was programmed */
+void inc_flash_write(uint32_t bank, int kind, uint32_t n_host)
 {
-    cnt_flash_write += n_page;
+    add_relaxed(&cnt_flash_write, 1);
+    add_relaxed(&cnt_host_sect, n_host);
+    banks[bank].write++;
+    banks[bank].prog[kind]++;
+    banks[bank].host_sect += n_host;
 }
 
-void inc_flash_cb(uint64_t n_page)
+/* A page of the given kind was copied back */
+void inc_flash_cb(uint32_t bank, int kind)
 {
-    cnt_flash_cb += n_page;
+    add_relaxed(&cnt_flash_cb, 1);
+    banks[bank].cb++;
+    banks[bank].prog[kind]++;
 }
 
-void inc_flash_erase(uint64_t n_blk)
+void inc_flash_erase(uint32_t bank, uint32_t blk)
 {
-    cnt_flash_erase += n_blk;
+    add_relaxed(&cnt_flash_erase, 1);
+    banks[bank].erase++;
+    blk_erase[bank * geo.blocks_per_bank + blk]++;
 }
 
 uint64_t get_byte_write(void)
@@ -45,7 +137,320 @@ uint64_t get_byte_write(void)
     return byte_write;
 }
 
-int open_stat(void)
+uint64_t get_requests(void)
+{
+    return cnt_req;
+}
+
+/* Read the counters from another thread */
+void get_progress(stat_progress_t *sp)
+{
+    sp->requests = __atomic_load_n(&cnt_req, __ATOMIC_RELAXED);
+    sp->byte_read = __atomic_load_n(&byte_read, __ATOMIC_RELAXED);
+    sp->byte_write = __atomic_load_n(&byte_write, __ATOMIC_RELAXED);
+    sp->flash_read = __atomic_load_n(&cnt_flash_read, __ATOMIC_RELAXED);
+    sp->flash_prog = __atomic_load_n(&cnt_flash_write, __ATOMIC_RELAXED) +
+            __atomic_load_n(&cnt_flash_cb, __ATOMIC_RELAXED);
+    sp->flash_erase = __atomic_load_n(&cnt_flash_erase, __ATOMIC_RELAXED);
+    sp->host_sect = __atomic_load_n(&cnt_host_sect, __ATOMIC_RELAXED);
+}
+
+static inline uint32_t hist_idx(uint64_t v)
+{
+    int msb, shift;
+
+    if (v < 2 * HIST_HALF)
+        return (uint32_t)v;
+    msb = 63 - __builtin_clzll(v);
+    shift = msb - HIST_SUB_BITS + 1;
+    return (uint32_t)((shift + 1) * HIST_HALF + (v >> shift) - HIST_HALF);
+}
+
+/* Largest value counted in bucket i */
+static uint64_t hist_value(uint32_t i)
+{
+    int shift;
+
+    if (i < 2 * HIST_HALF)
+        return i;
+    shift = i / HIST_HALF - 1;
+    return ((uint64_t)(i % HIST_HALF + HIST_HALF + 1) << shift) - 1;
+}
+
+/* Record the latency in ns of a request of n_byte bytes */
+void add_latency(uint32_t rw, uint64_t n_byte, uint64_t ns)
+{
+    int c = 0;
+
+    while (n_byte > size_class_max[c])
+        c++;
+    hist[rw != 0][c][hist_idx(ns)]++;
+    add_relaxed(&cnt_req, 1);
+}
+
+/* Name the clock that latencies are measured with */
+void set_latency_clock(const char *name)
+{
+    lat_clock = name;
+}
+
+static void print_latency(const char *name, const char *key,
+                          const uint64_t *h)
+{
+    static const double pct[] = {50, 99, 99.9};
+    uint64_t n, acc, max, p[3];
+    uint32_t i;
+    int k;
+
+    n = 0;
+    max = 0;
+    for (i = 0; i < HIST_SIZE; i++) {
+        n += h[i];
+        if (h[i] != 0)
+            max = hist_value(i);
+    }
+    if (n == 0)
+        return;
+    acc = 0;
+    k = 0;
+    for (i = 0; i < HIST_SIZE && k < 3; i++) {
+        acc += h[i];
+        /* the smallest value at or above the given share of requests */
+        while (k < 3 && acc * 100.0 >= pct[k] * n)
+            p[k++] = hist_value(i);
+    }
+    printf("%-12s %10" PRIu64 " %10.1f %10.1f %10.1f %10.1f\n", name, n,
+            p[0] / 1000.0, p[1] / 1000.0, p[2] / 1000.0, max / 1000.0);
+
+    res_begin(key);
+    res_u64("count", n);
+    res_dbl("p50_us", p[0] / 1000.0);
+    res_dbl("p99_us", p[1] / 1000.0);
+    res_dbl("p999_us", p[2] / 1000.0);
+    res_dbl("max_us", max / 1000.0);
+    res_end();
+}
+
+static inline uint64_t bank_prog(const bank_stat_t *bs)
+{
+    return bs->prog[STAT_HOST] + bs->prog[STAT_GC] + bs->prog[STAT_META];
+}
+
+/* Pages programmed per page of host sectors, NaN before any host sector */
+static inline double waf(uint64_t prog, uint64_t host_sect)
+{
+    return host_sect != 0 ?
+            (double)prog * geo.sectors_per_page / host_sect : NAN;
+}
+
+/* Write a WAF into the time series, leaving it empty if undefined */
+static void put_waf(double w)
+{
+    if (isnan(w))
+        fputc(',', series_fp);
+    else
+        fprintf(series_fp, ",%.4f", w);
+}
+
+static void get_erase_dist(const uint32_t *cnt, uint32_t n, erase_dist_t *d)
+{
+    double sum, sq;
+
+    d->min = UINT32_MAX;
+    d->max = 0;
+    sum = 0;
+    sq = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        if (cnt[i] < d->min)
+            d->min = cnt[i];
+        if (cnt[i] > d->max)
+            d->max = cnt[i];
+        sum += cnt[i];
+        sq += (double)cnt[i] * cnt[i];
+    }
+    d->mean = sum / n;
+    d->sd = sqrt(fmax(sq / n - d->mean * d->mean, 0));
+}
+
+static void sample_series(void)
+{
+    uint64_t prog, host, total_prog, total_host;
+    uint64_t *prev = series_prev;
+    erase_dist_t d;
+    uint32_t i, n = geo.num_banks;
+
+    total_prog = 0;
+    total_host = 0;
+    for (i = 0; i < n; i++) {
+        total_prog += bank_prog(&banks[i]);
+        total_host += banks[i].host_sect;
+    }
+    get_erase_dist(blk_erase, geo.num_blocks, &d);
+    fprintf(series_fp, "%.3f,%" PRIu64 ",%" PRIu64 ",%" PRIu64,
+            byte_write / 1073741824.0, cnt_flash_write, cnt_flash_cb,
+            cnt_flash_erase);
+    put_waf(waf(total_prog, total_host));
+    put_waf(waf(total_prog - prev[2 * n], total_host - prev[2 * n + 1]));
+    fprintf(series_fp, ",%u,%u,%.3f,%.3f", d.min, d.max, d.mean, d.sd);
+    for (i = 0; i < n; i++) {
+        prog = bank_prog(&banks[i]);
+        host = banks[i].host_sect;
+        put_waf(waf(prog - prev[2 * i], host - prev[2 * i + 1]));
+        prev[2 * i] = prog;
+        prev[2 * i + 1] = host;
+    }
+    prev[2 * n] = total_prog;
+    prev[2 * n + 1] = total_host;
+    for (i = 0; i < n; i++)
+        fprintf(series_fp, ",%" PRIu64, banks[i].erase);
+    fputc('\n', series_fp);
+
+    series_last = byte_write;
+    while (series_next <= byte_write)
+        series_next += series_step;
+}
+
+static int open_series(const char *path, double gb)
+{
+    uint32_t i;
+
+    series_step = (uint64_t)(gb * 1073741824.0);
+    if (series_step == 0)
+        return 1;
+    series_prev = (uint64_t *)calloc(2 * (geo.num_banks + 1),
+            sizeof(uint64_t));
+    series_fp = fopen(path, "w");
+    if (series_prev == NULL || series_fp == NULL)
+        return 1;
+    series_next = series_step;
+    series_last = 0;
+    fputs("host_gb,flash_write,flash_cb,flash_erase,waf,waf_interval,"
+            "erase_min,erase_max,erase_mean,erase_sd", series_fp);
+    for (i = 0; i < geo.num_banks; i++)
+        fprintf(series_fp, ",waf_interval_bank%u", i);
+    for (i = 0; i < geo.num_banks; i++)
+        fprintf(series_fp, ",erase_bank%u", i);
+    fputc('\n', series_fp);
+    return 0;
+}
+
+/* Banks without host sectors have no WAF and show "-" */
+static void print_bank(const char *name, const bank_stat_t *bs,
+                       const erase_dist_t *d)
+{
+    double w = waf(bank_prog(bs), bs->host_sect);
+
+    printf("%-5s %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64
+            " %10" PRIu64 " %8" PRIu64, name, bs->read, bs->prog[STAT_HOST],
+            bs->prog[STAT_GC], bs->prog[STAT_META], bs->cb, bs->erase);
+    if (isnan(w))
+        printf(" %8s", "-");
+    else
+        printf(" %8.3f", w);
+    printf(" %6u %6u %8.2f\n", d->min, d->max, d->sd);
+}
+
+/**
+ * Print the flash operations and write amplification of each bank and the
+ * erase count distribution of its blocks, then of all blocks
+ */
+static void print_wear(void)
+{
+    static const double pct[] = {1, 50, 99};
+    bank_stat_t all;
+    erase_dist_t d;
+    uint32_t *tally;
+    uint32_t p[3];
+    uint64_t acc;
+    uint32_t i, k;
+    char name[16];
+    double w, waf_min, waf_max;
+
+    printf("----------Wear Results----------\n");
+    printf("%-5s %10s %10s %10s %10s %10s %8s %8s %6s %6s %8s\n",
+            "bank", "read", "host", "gc", "meta", "copyback", "erase", "WAF",
+            "ersmin", "ersmax", "erssd");
+    memset(&all, 0, sizeof(all));
+    waf_min = INFINITY;
+    waf_max = -INFINITY;
+    for (i = 0; i < geo.num_banks; i++) {
+        get_erase_dist(&blk_erase[i * geo.blocks_per_bank],
+                geo.blocks_per_bank, &d);
+        snprintf(name, sizeof(name), "%u", i);
+        print_bank(name, &banks[i], &d);
+        all.read += banks[i].read;
+        all.cb += banks[i].cb;
+        all.erase += banks[i].erase;
+        for (k = 0; k < 3; k++)
+            all.prog[k] += banks[i].prog[k];
+        all.host_sect += banks[i].host_sect;
+        /* fmin() and fmax() skip the NaN of banks without host sectors */
+        w = waf(bank_prog(&banks[i]), banks[i].host_sect);
+        waf_min = fmin(waf_min, w);
+        waf_max = fmax(waf_max, w);
+    }
+    get_erase_dist(blk_erase, geo.num_blocks, &d);
+    print_bank("all", &all, &d);
+    res_begin("wear");
+    res_u64("host_pages", all.prog[STAT_HOST]);
+    res_u64("host_sectors", all.host_sect);
+    res_u64("gc_pages", all.prog[STAT_GC]);
+    res_u64("meta_pages", all.prog[STAT_META]);
+    /* the WAF is left out until there are host sectors */
+    if (all.host_sect != 0) {
+        res_dbl("waf", waf(bank_prog(&all), all.host_sect));
+        res_dbl("waf_bank_min", waf_min);
+        res_dbl("waf_bank_max", waf_max);
+    }
+    res_u64("erase_min", d.min);
+    res_u64("erase_max", d.max);
+    res_dbl("erase_mean", d.mean);
+    res_dbl("erase_sd", d.sd);
+
+    /* percentiles by counting the blocks at each erase count */
+    tally = (uint32_t *)calloc((uint64_t)d.max + 1, sizeof(uint32_t));
+    if (tally != NULL) {
+        for (i = 0; i < geo.num_blocks; i++)
+            tally[blk_erase[i]]++;
+        acc = 0;
+        k = 0;
+        for (i = 0; i <= d.max && k < 3; i++) {
+            acc += tally[i];
+            while (k < 3 && acc * 100.0 >= pct[k] * geo.num_blocks)
+                p[k++] = i;
+        }
+        printf("Block erases: min %u, p1 %u, p50 %u, p99 %u, max %u, "
+                "mean %.2f, sd %.2f\n", d.min, p[0], p[1], p[2], d.max,
+                d.mean, d.sd);
+        res_u64("erase_p1", p[0]);
+        res_u64("erase_p50", p[1]);
+        res_u64("erase_p99", p[2]);
+        free(tally);
+    }
+    res_end();
+    printf("----------Wear Results----------\n");
+}
+
+/**
+ * Write the row of the tail of the run since the last one and stop the time
+ * series.  Called at the end of the trace, so that the final cache flush
+ * does not skew the last interval.
+ */
+void close_series(void)
+{
+    if (series_fp == NULL)
+        return;
+    if (byte_write > series_last)
+        sample_series();
+    fclose(series_fp);
+    series_fp = NULL;
+}
+
+/**
+ * Start counting; with series set, also write a time series of the counters
+ * to that file every series_gb GB of host writes
+ */
+int open_stat(const char *series, double series_gb)
 {
     byte_read = 0;
     byte_write = 0;
@@ -53,6 +458,18 @@ int open_stat(void)
     cnt_flash_write = 0;
     cnt_flash_cb = 0;
     cnt_flash_erase = 0;
+    cnt_host_sect = 0;
+    cnt_req = 0;
+    memset(hist, 0, sizeof(hist));
+    lat_clock = "wall clock";
+    banks = (bank_stat_t *)calloc(geo.num_banks, sizeof(bank_stat_t));
+    blk_erase = (uint32_t *)calloc(geo.num_blocks, sizeof(uint32_t));
+    if (banks == NULL || blk_erase == NULL)
+        return 1;
+    if (series != NULL && open_series(series, series_gb)) {
+        fprintf(stderr, "Fail opening time series %s.\n", series);
+        return 1;
+    }
     return 0;
 }
 
@@ -70,4 +487,50 @@ void close_stat(void)
     printf("Total flash copyback (pages): %" PRIu64 "\n", cnt_flash_cb);
     printf("Total flash erase (blocks): %" PRIu64 "\n", cnt_flash_erase);
     printf("----------Statistic Results----------\n");
+    res_begin("stat");
+    res_u64("read_bytes", byte_read);
+    res_u64("write_bytes", byte_write);
+    res_u64("flash_read", cnt_flash_read);
+    res_u64("flash_write", cnt_flash_write);
+    res_u64("flash_copyback", cnt_flash_cb);
+    res_u64("flash_erase", cnt_flash_erase);
+    res_end();
+
+    static const char *dir_name[2] = {"write", "read"};
+    uint64_t all[HIST_SIZE];
+    char name[32], key[32];
+
+    printf("----------Latency (us, %s)----------\n", lat_clock);
+    printf("%-12s %10s %10s %10s %10s %10s\n",
+            "request", "count", "p50", "p99", "p99.9", "max");
+    res_begin("latency");
+    res_str("clock", lat_clock);
+    for (int d = 0; d < 2; d++) {
+        memset(all, 0, sizeof(all));
+        for (int c = 0; c < N_SIZE_CLASS; c++) {
+            for (uint32_t i = 0; i < HIST_SIZE; i++)
+                all[i] += hist[d][c][i];
+        }
+        print_latency(dir_name[d], dir_name[d], all);
+        for (int c = 0; c < N_SIZE_CLASS; c++) {
+            snprintf(name, sizeof(name), "%s %s", dir_name[d],
+                    size_class_name[c]);
+            snprintf(key, sizeof(key), "%s_%s", dir_name[d],
+                    size_class_key[c]);
+            print_latency(name, key, hist[d][c]);
+        }
+    }
+    res_end();
+    printf("----------Latency (us, %s)----------\n", lat_clock);
+
+    if (banks == NULL || blk_erase == NULL)
+        return;
+    print_wear();
+    close_series();
+    free(series_prev);
+    free(blk_erase);
+    free(banks);
+    series_prev = NULL;
+    blk_erase = NULL;
+    banks = NULL;
 }
@@ -6,14 +6,39 @@
 #ifndef STAT_H
 #define STAT_H
 
+#include <stdint.h>
+
+/* what a programmed flash page holds */
+enum {
+    STAT_HOST,  /* host data from the write buffer */
+    STAT_GC,    /* host data relocated by the FTL */
+    STAT_META   /* FTL metadata */
+};
+
+/* counters sampled while the simulation runs */
+typedef struct {
+    uint64_t requests;
+    uint64_t byte_read;
+    uint64_t byte_write;
+    uint64_t flash_read;
+    uint64_t flash_prog;
+    uint64_t flash_erase;
+    uint64_t host_sect;
+} stat_progress_t;
+
 void inc_byte_read(uint64_t n_byte);
 void inc_byte_write(uint64_t n_byte);
-void inc_flash_read(uint64_t n_page);
-void inc_flash_write(uint64_t n_page);
-void inc_flash_cb(uint64_t n_page);
-void inc_flash_erase(uint64_t n_blk);
+void inc_flash_read(uint32_t bank);
+void inc_flash_write(uint32_t bank, int kind, uint32_t n_host);
+void inc_flash_cb(uint32_t bank, int kind);
+void inc_flash_erase(uint32_t bank, uint32_t blk);
 uint64_t get_byte_write(void);
-int open_stat(void);
+uint64_t get_requests(void);
+void get_progress(stat_progress_t *sp);
+void add_latency(uint32_t rw, uint64_t n_byte, uint64_t ns);
+void set_latency_clock(const char *name);
+int open_stat(const char *series, double series_gb);
+void close_series(void);
 void close_stat(void);
 
 #endif // STAT_H
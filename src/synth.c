@@ -0,0 +1,414 @@
+/**
+ * synth.c
+ * Synthetic workload generators
+ * Authors: Yun-Sheng Chang
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "synth.h"
+
+/**
+ * A synthetic workload is described by a spec such as
+ * "zipf,theta=1.2,read=0.3,size=8:0.9/256:0.1": an address pattern
+ * followed by parameters.  Requests are drawn from a seeded PRNG, so a spec
+ * always yields the same request sequence.  Each pass is n requests long
+ * and continues the random stream of the previous one.
+ */
+enum synth_pattern {
+    SYNTH_UNIFORM,
+    SYNTH_ZIPF,
+    SYNTH_HOTCOLD,
+    SYNTH_SEQ
+};
+
+/* at most this many choices in a size mix */
+#define SYNTH_MAX_SIZES 16
+
+static enum synth_pattern pattern;
+static uint64_t n_req, n_lba, seed;
+static double read_ratio;
+static uint32_t align;
+static uint64_t n_unit;
+/* size distribution: uniform in [size_lo, size_hi] or a weighted mix */
+static uint32_t size_lo, size_hi;
+static int n_size;
+static uint32_t sizes[SYNTH_MAX_SIZES];
+static double size_cdf[SYNTH_MAX_SIZES];
+/* zipf */
+static double theta;
+static double zipf_hx1, zipf_hn, zipf_s;
+/* hot/cold */
+static double hot_space, hot_io;
+static uint64_t n_hot;
+/* sequential streams */
+static uint32_t n_stream;
+static uint64_t *stream_pos;
+/* Poisson arrivals; timestamps stay 0 if iops is 0 */
+static double iops;
+static double now;
+
+static uint64_t rng[4];
+static uint64_t pos;
+static struct trace_ent *buf;
+
+static uint64_t splitmix64(uint64_t *x)
+{
+    uint64_t z;
+
+    z = (*x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static inline uint64_t rotl(uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+/* xoshiro256** */
+static inline uint64_t next_u64(void)
+{
+    uint64_t r, t;
+
+    r = rotl(rng[1] * 5, 7) * 9;
+    t = rng[1] << 17;
+    rng[2] ^= rng[0];
+    rng[3] ^= rng[1];
+    rng[1] ^= rng[2];
+    rng[0] ^= rng[3];
+    rng[2] ^= t;
+    rng[3] = rotl(rng[3], 45);
+    return r;
+}
+
+/* uniform in [0, 1) */
+static inline double next_double(void)
+{
+    return (next_u64() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* uniform in [0, n) */
+static inline uint64_t next_below(uint64_t n)
+{
+    return (uint64_t)(next_double() * n);
+}
+
+/**
+ * Zipf sampling by rejection-inversion (Hoermann and Derflinger), which
+ * needs O(1) setup and memory for any number of elements
+ */
+static double helper1(double x)
+{
+    if (fabs(x) > 1e-8)
+        return log1p(x) / x;
+    return 1 - x * (0.5 - x * (1.0 / 3 - 0.25 * x));
+}
+
+static double helper2(double x)
+{
+    if (fabs(x) > 1e-8)
+        return expm1(x) / x;
+    return 1 + x * 0.5 * (1 + x * (1.0 / 3) * (1 + 0.25 * x));
+}
+
+static double zipf_h(double x)
+{
+    return exp(-theta * log(x));
+}
+
+static double zipf_hint(double x)
+{
+    double lx = log(x);
+
+    return helper2((1 - theta) * lx) * lx;
+}
+
+static double zipf_hint_inv(double x)
+{
+    double t = x * (1 - theta);
+
+    if (t < -1)
+        t = -1;
+    return exp(helper1(t) * x);
+}
+
+static void init_zipf(void)
+{
+    zipf_hx1 = zipf_hint(1.5) - 1;
+    zipf_hn = zipf_hint(n_unit + 0.5);
+    zipf_s = 2 - zipf_hint_inv(zipf_hint(2.5) - zipf_h(2));
+}
+
+/* rank in [1, n_unit], rank 1 being the most popular */
+static uint64_t next_zipf(void)
+{
+    double u, x;
+    uint64_t k;
+
+    for (;;) {
+        u = zipf_hn + next_double() * (zipf_hx1 - zipf_hn);
+        x = zipf_hint_inv(u);
+        k = (uint64_t)(x + 0.5);
+        if (k < 1)
+            k = 1;
+        else if (k > n_unit)
+            k = n_unit;
+        if (k - x <= zipf_s || u >= zipf_hint(k + 0.5) - zipf_h(k))
+            return k;
+    }
+}
+
+/* spread popular ranks over the address space */
+static inline uint64_t scramble(uint64_t k)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    for (int i = 0; i < 8; i++) {
+        h ^= (k >> (i * 8)) & 0xff;
+        h *= 0x100000001b3ULL;
+    }
+    return h % n_unit;
+}
+
+static uint32_t next_size(void)
+{
+    double u;
+    int i;
+
+    if (n_size == 0)
+        return size_lo + (uint32_t)next_below(size_hi - size_lo + 1);
+    u = next_double();
+    for (i = 0; i < n_size - 1 && u >= size_cdf[i]; i++)
+        ;
+    return sizes[i];
+}
+
+static void gen(struct trace_ent *e)
+{
+    uint64_t lba;
+    uint32_t size, s;
+
+    size = next_size();
+    switch (pattern) {
+    case SYNTH_ZIPF:
+        lba = scramble(next_zipf() - 1) * align;
+        break;
+    case SYNTH_HOTCOLD:
+        if (next_double() < hot_io || n_hot == n_unit)
+            lba = next_below(n_hot) * align;
+        else
+            lba = (n_hot + next_below(n_unit - n_hot)) * align;
+        break;
+    case SYNTH_SEQ:
+        s = (uint32_t)next_below(n_stream);
+        if (stream_pos[s] >= n_lba)
+            stream_pos[s] = 0;
+        lba = stream_pos[s];
+        stream_pos[s] += size;
+        break;
+    default:
+        lba = next_below(n_unit) * align;
+        break;
+    }
+    if (lba + size > n_lba)
+        size = (uint32_t)(n_lba - lba);
+
+    e->lba = (uint32_t)lba;
+    e->sec_num = size;
+    e->rw = (next_double() < read_ratio);
+    e->dev = 0;
+    if (iops > 0)
+        now += -log1p(-next_double()) / iops * 1e9;
+    e->ts = (uint64_t)now;
+}
+
+/* Parse "<n>", "<lo>-<hi>" or "<n>:<weight>/<n>:<weight>/..." */
+static int parse_size(const char *s)
+{
+    char *end;
+    double w, total;
+
+    n_size = 0;
+    size_lo = (uint32_t)strtoul(s, &end, 0);
+    if (*end == '\0') {
+        size_hi = size_lo;
+        return size_lo == 0;
+    }
+    if (*end == '-') {
+        size_hi = (uint32_t)strtoul(end + 1, &end, 0);
+        return *end != '\0' || size_lo == 0 || size_hi < size_lo;
+    }
+
+    total = 0;
+    for (;;) {
+        if (n_size == SYNTH_MAX_SIZES || *end != ':')
+            return 1;
+        w = strtod(end + 1, &end);
+        if (size_lo == 0 || !(w > 0))
+            return 1;
+        sizes[n_size] = size_lo;
+        total += w;
+        size_cdf[n_size++] = total;
+        if (*end == '\0')
+            break;
+        if (*end != '/')
+            return 1;
+        size_lo = (uint32_t)strtoul(end + 1, &end, 0);
+    }
+    for (int i = 0; i < n_size; i++)
+        size_cdf[i] /= total;
+    return 0;
+}
+
+static int parse_param(char *kv)
+{
+    char *v, *end;
+
+    v = strchr(kv, '=');
+    if (v == NULL)
+        return 1;
+    *v++ = '\0';
+    end = NULL;
+    if (strcmp(kv, "n") == 0)
+        n_req = strtoull(v, &end, 0);
+    else if (strcmp(kv, "lbas") == 0)
+        n_lba = strtoull(v, &end, 0);
+    else if (strcmp(kv, "seed") == 0)
+        seed = strtoull(v, &end, 0);
+    else if (strcmp(kv, "read") == 0)
+        read_ratio = strtod(v, &end);
+    else if (strcmp(kv, "align") == 0)
+        align = (uint32_t)strtoul(v, &end, 0);
+    else if (strcmp(kv, "size") == 0)
+        return parse_size(v);
+    else if (strcmp(kv, "theta") == 0)
+        theta = strtod(v, &end);
+    else if (strcmp(kv, "hot") == 0)
+        hot_space = strtod(v, &end);
+    else if (strcmp(kv, "hotio") == 0)
+        hot_io = strtod(v, &end);
+    else if (strcmp(kv, "streams") == 0)
+        n_stream = (uint32_t)strtoul(v, &end, 0);
+    else if (strcmp(kv, "iops") == 0)
+        iops = strtod(v, &end);
+    else
+        return 1;
+    return *end != '\0';
+}
+
+static int parse_spec(const char *spec)
+{
+    char *s, *tok, *save;
+    int ret;
+
+    s = strdup(spec);
+    if (s == NULL)
+        return 1;
+    ret = 1;
+    tok = strtok_r(s, ",", &save);
+    if (tok == NULL)
+        goto out;
+    if (strcmp(tok, "uniform") == 0)
+        pattern = SYNTH_UNIFORM;
+    else if (strcmp(tok, "zipf") == 0)
+        pattern = SYNTH_ZIPF;
+    else if (strcmp(tok, "hotcold") == 0)
+        pattern = SYNTH_HOTCOLD;
+    else if (strcmp(tok, "seq") == 0)
+        pattern = SYNTH_SEQ;
+    else
+        goto out;
+    while ((tok = strtok_r(NULL, ",", &save)) != NULL) {
+        if (parse_param(tok)) {
+            fprintf(stderr, "Invalid synthetic workload parameter %s.\n",
+                    tok);
+            goto out;
+        }
+    }
+    ret = 0;
+out:
+    free(s);
+    return ret;
+}
+
+/**
+ * Open the synthetic workload described by spec over n_lba sectors, unless
+ * the spec gives its own lbas
+ */
+int open_synth(const char *spec, uint64_t n_lba_dft)
+{
+    n_req = 1 << 20;
+    n_lba = n_lba_dft;
+    seed = 1;
+    read_ratio = 0;
+    align = 8;
+    size_lo = size_hi = 8;
+    n_size = 0;
+    theta = 0.99;
+    hot_space = 0.2;
+    hot_io = 0.8;
+    n_stream = 1;
+    iops = 0;
+    if (parse_spec(spec))
+        return 1;
+
+    if (n_lba == 0 || n_lba > (uint64_t)UINT32_MAX + 1 || align == 0 ||
+            n_lba < align || n_stream == 0 || !(theta > 0) ||
+            read_ratio < 0 || read_ratio > 1 || hot_space <= 0 ||
+            hot_space > 1 || hot_io < 0 || hot_io > 1 || iops < 0)
+        return 1;
+    n_unit = n_lba / align;
+    n_hot = (uint64_t)(hot_space * n_unit);
+    if (n_hot == 0)
+        n_hot = 1;
+    if (pattern == SYNTH_ZIPF)
+        init_zipf();
+
+    buf = (struct trace_ent *)malloc(TRACE_CHUNK_SIZE * sizeof(*buf));
+    stream_pos = (uint64_t *)malloc(n_stream * sizeof(*stream_pos));
+    if (buf == NULL || stream_pos == NULL) {
+        close_synth();
+        return 1;
+    }
+    /* streams start evenly spaced */
+    for (uint32_t i = 0; i < n_stream; i++)
+        stream_pos[i] = n_unit * i / n_stream * align;
+    for (int i = 0; i < 4; i++)
+        rng[i] = splitmix64(&seed);
+    now = 0;
+    pos = 0;
+    return 0;
+}
+
+void close_synth(void)
+{
+    free(buf);
+    buf = NULL;
+    free(stream_pos);
+    stream_pos = NULL;
+}
+
+uint32_t synth_read(const struct trace_ent **ents)
+{
+    uint32_t n;
+
+    n = (n_req - pos > TRACE_CHUNK_SIZE) ?
+            TRACE_CHUNK_SIZE : (uint32_t)(n_req - pos);
+    for (uint32_t i = 0; i < n; i++)
+        gen(&buf[i]);
+    pos += n;
+    *ents = buf;
+    return n;
+}
+
+void synth_rewind(void)
+{
+    pos = 0;
+}
@@ -0,0 +1,20 @@
+/**
+ * synth.h
+ * Authors: Yun-Sheng Chang
+ */
+
+#ifndef SYNTH_H
+#define SYNTH_H
+
+#include <stdint.h>
+#include "trace.h"
+
+/* prefix of trace names that denote synthetic workloads */
+#define SYNTH_PREFIX "synth:"
+
+int open_synth(const char *spec, uint64_t n_lba);
+void close_synth(void);
+uint32_t synth_read(const struct trace_ent **ents);
+void synth_rewind(void);
+
+#endif // SYNTH_H
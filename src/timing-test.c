@@ -0,0 +1,145 @@
+/**
+ * timing-test.c
+ * Test of the timing wheel against a linear search
+ * Authors: Yun-Sheng Chang
+ */
+
+#include "timing.c"
+
+#define TEST_QD 64
+#define TEST_REQS 200000
+
+static uint64_t pending[TEST_QD];
+static uint32_t n_pending;
+
+static uint64_t rand_next(uint64_t *s)
+{
+    *s ^= *s << 13;
+    *s ^= *s >> 7;
+    *s ^= *s << 17;
+    return *s;
+}
+
+/* Remove and return the earliest of the pending completions */
+static uint64_t pending_pop(void)
+{
+    uint32_t m = 0;
+    uint64_t t;
+
+    for (uint32_t i = 1; i < n_pending; i++) {
+        if (pending[i] < pending[m])
+            m = i;
+    }
+    t = pending[m];
+    pending[m] = pending[--n_pending];
+    return t;
+}
+
+static void put(uint64_t t)
+{
+    uint32_t e = ev_free;
+
+    ev_free = events[e].next;
+    events[e].t = t;
+    wheel_put(e);
+    n_out++;
+    pending[n_pending++] = t;
+}
+
+static void reset(void)
+{
+    for (uint32_t i = 0; i < TEST_QD; i++)
+        events[i].next = (i + 1 < TEST_QD) ? i + 1 : WHEEL_NIL;
+    ev_free = 0;
+    for (uint32_t i = 0; i < WHEEL_SIZE; i++)
+        wheel[i] = WHEEL_NIL;
+    overflow = WHEEL_NIL;
+    ovf_min = UINT64_MAX;
+    wheel_cur = 0;
+    n_wheel = n_out = 0;
+    n_pending = 0;
+}
+
+static int expect(uint64_t got, uint64_t want, const char *what, uint32_t i)
+{
+    if (got == want)
+        return 0;
+    fprintf(stderr, "%s #%u: got %" PRIu64 ", expected %" PRIu64 "\n", what,
+            i, got, want);
+    return 1;
+}
+
+/**
+ * Completions that fall due in the overflow list while the wheel still
+ * holds later ones; the wheel reaches about 67 ms ahead
+ */
+static int test_overflow(void)
+{
+    /* put the completion at ms, or pop the earliest if ms is 0 */
+    static const uint32_t ops[] = {
+        60, 100, 0, 160, 200, 0, 140, 0, 205, 0, 0, 0
+    };
+    uint32_t n = sizeof(ops) / sizeof(ops[0]);
+
+    reset();
+    for (uint32_t i = 0; i < n; i++) {
+        if (ops[i] != 0) {
+            put(ops[i] * 1000000ULL);
+            continue;
+        }
+        uint64_t want = pending_pop();
+        if (expect(wheel_peek(), want, "overflow peek", i) ||
+                expect(wheel_pop(), want, "overflow pop", i))
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * Replay a queue of requests that last from 1 us to 1 s, retiring due
+ * completions and waiting for the earliest when the queue is full, as
+ * tm_submit() does
+ */
+static int test_random(void)
+{
+    uint64_t s = 88172645463325252ULL, t_now = 0, t;
+
+    reset();
+    for (uint32_t i = 0; i < TEST_REQS; i++) {
+        while (n_pending > 0 && wheel_peek() <= t_now) {
+            if (expect(wheel_pop(), pending_pop(), "due pop", i))
+                return 1;
+        }
+        if (n_pending == TEST_QD) {
+            t = pending_pop();
+            if (expect(wheel_pop(), t, "full pop", i))
+                return 1;
+            if (t > t_now)
+                t_now = t;
+        }
+        /* one in eight lasts up to 1 s, beyond the range of the wheel */
+        t = rand_next(&s);
+        t = (t & 7) == 0 ? (t >> 8) % 1000000000 : (t >> 8) % 2000000;
+        put(t_now + 1000 + t);
+        t_now += rand_next(&s) % 100000;
+    }
+    while (n_pending > 0) {
+        if (expect(wheel_pop(), pending_pop(), "drain pop", 0))
+            return 1;
+    }
+    return 0;
+}
+
+int main(void)
+{
+    int fail;
+
+    events = (struct tm_event *)malloc(TEST_QD * sizeof(struct tm_event));
+    if (events == NULL)
+        return 1;
+    fail = test_overflow();
+    fail |= test_random();
+    free(events);
+    printf("timing wheel: %s\n", fail ? "FAIL" : "ok");
+    return fail;
+}
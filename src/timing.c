@@ -0,0 +1,459 @@
+/**
+ * timing.c
+ * Timing model of flash operations and host requests
+ * Authors: Yun-Sheng Chang
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "config.h"
+#include "geometry.h"
+#include "timing.h"
+#include "results.h"
+
+/**
+ * Each bank and each channel is busy until a given time.  A flash operation
+ * starts once its request is issued and its bank is free, and holds the
+ * channel while data moves between the controller and the bank: before
+ * programming a page and after reading one.  A request completes when the
+ * last flash operation it triggered completes, or at issue if it triggered
+ * none.
+ *
+ * Requests arrive at their trace timestamps, or all at once without them,
+ * but at most qd of them are outstanding and the FTL issues them in order.
+ * Flash operations before the first request, such as formatting, take no
+ * time.  Completions of outstanding requests wait in a timing wheel: a ring
+ * of buckets of 2^WHEEL_SHIFT ns each, plus an overflow list for
+ * completions beyond the ring that move into the ring as it comes within
+ * reach of them, so retiring the earliest completion costs O(1) amortized.
+ */
+#define WHEEL_SHIFT 14
+#define WHEEL_SIZE 4096
+#define WHEEL_NIL UINT32_MAX
+
+struct tm_event {
+    uint64_t t;
+    uint32_t next;
+};
+
+static int timing_on;
+/* parameters, in ns */
+static uint64_t t_read, t_prog, t_erase, t_xfer;
+static uint32_t qd;
+static int use_ts;
+
+static uint64_t *bank_free, *chnl_free;
+static uint32_t *bank_chnl;
+static uint32_t n_chnl;
+
+/* timing wheel of outstanding requests */
+static struct tm_event *events;
+static uint32_t ev_free;
+static uint32_t wheel[WHEEL_SIZE];
+static uint64_t wheel_cur;
+static uint32_t n_wheel;
+static uint32_t overflow;
+/* earliest completion in the overflow list */
+static uint64_t ovf_min = UINT64_MAX;
+static uint32_t n_out;
+
+/* the request in progress: issued at now, completed at req_done */
+static uint64_t now, req_done, req_arrival;
+static uint64_t ts_first, ts_base, ts_last;
+static int ts_seen, started;
+
+static uint64_t n_req, n_read, byte_read, byte_write;
+static uint64_t t_end;
+
+static void wheel_put(uint32_t e)
+{
+    uint64_t b = events[e].t >> WHEEL_SHIFT;
+    uint32_t *head;
+
+    if (b < wheel_cur)
+        b = wheel_cur;
+    if (b >= wheel_cur + WHEEL_SIZE) {
+        head = &overflow;
+        if (events[e].t < ovf_min)
+            ovf_min = events[e].t;
+    } else {
+        head = &wheel[b % WHEEL_SIZE];
+        n_wheel++;
+    }
+    events[e].next = *head;
+    *head = e;
+}
+
+/* Move the overflow list into the wheel as far as the wheel reaches */
+static void wheel_spill(void)
+{
+    uint32_t e = overflow, next;
+
+    overflow = WHEEL_NIL;
+    ovf_min = UINT64_MAX;
+    for (; e != WHEEL_NIL; e = next) {
+        next = events[e].next;
+        wheel_put(e);
+    }
+}
+
+/* Restart an empty wheel at the earliest completion in the overflow list */
+static void wheel_refill(void)
+{
+    wheel_cur = ovf_min >> WHEEL_SHIFT;
+    wheel_spill();
+}
+
+/* Go to the next bucket, taking in the completions it brings into reach */
+static void wheel_next(void)
+{
+    wheel_cur++;
+    if ((ovf_min >> WHEEL_SHIFT) < wheel_cur + WHEEL_SIZE)
+        wheel_spill();
+}
+
+/* Remove and return the earliest completion; the wheel must not be empty */
+static uint64_t wheel_pop(void)
+{
+    uint32_t *pe, *pmin, e;
+    uint64_t t;
+
+    if (n_wheel == 0)
+        wheel_refill();
+    for (;; wheel_next()) {
+        pmin = NULL;
+        for (pe = &wheel[wheel_cur % WHEEL_SIZE]; *pe != WHEEL_NIL;
+                pe = &events[*pe].next) {
+            if (pmin == NULL || events[*pe].t < events[*pmin].t)
+                pmin = pe;
+        }
+        if (pmin != NULL)
+            break;
+    }
+    e = *pmin;
+    *pmin = events[e].next;
+    n_wheel--;
+    t = events[e].t;
+    events[e].next = ev_free;
+    ev_free = e;
+    n_out--;
+    return t;
+}
+
+/* Earliest completion, or UINT64_MAX if nothing is outstanding */
+static uint64_t wheel_peek(void)
+{
+    uint64_t t = UINT64_MAX;
+
+    if (n_out == 0)
+        return t;
+    if (n_wheel == 0)
+        wheel_refill();
+    while (wheel[wheel_cur % WHEEL_SIZE] == WHEEL_NIL)
+        wheel_next();
+    for (uint32_t e = wheel[wheel_cur % WHEEL_SIZE]; e != WHEEL_NIL;
+            e = events[e].next) {
+        if (events[e].t < t)
+            t = events[e].t;
+    }
+    return t;
+}
+
+static int parse_param(char *kv)
+{
+    char *v, *end;
+    double x;
+
+    if (strcmp(kv, "on") == 0)
+        return 0;
+    v = strchr(kv, '=');
+    if (v == NULL)
+        return 1;
+    *v++ = '\0';
+    x = strtod(v, &end);
+    if (*end != '\0' || !(x >= 0))
+        return 1;
+    /* times are given in us */
+    if (strcmp(kv, "tR") == 0)
+        t_read = (uint64_t)(x * 1000);
+    else if (strcmp(kv, "tPROG") == 0)
+        t_prog = (uint64_t)(x * 1000);
+    else if (strcmp(kv, "tBERS") == 0)
+        t_erase = (uint64_t)(x * 1000);
+    else if (strcmp(kv, "xfer") == 0)
+        t_xfer = (uint64_t)(x * 1000);
+    else if (strcmp(kv, "qd") == 0 && x >= 1)
+        qd = (uint32_t)x;
+    else if (strcmp(kv, "ts") == 0)
+        use_ts = (x != 0);
+    else
+        return 1;
+    return 0;
+}
+
+static int parse_spec(const char *spec)
+{
+    char *s, *tok, *save;
+    int ret;
+
+    s = strdup(spec);
+    if (s == NULL)
+        return 1;
+    ret = 0;
+    for (tok = strtok_r(s, ",", &save); tok != NULL;
+            tok = strtok_r(NULL, ",", &save)) {
+        if (parse_param(tok)) {
+            fprintf(stderr, "Invalid timing parameter %s.\n", tok);
+            ret = 1;
+            break;
+        }
+    }
+    free(s);
+    return ret;
+}
+
+/**
+ * Enable the timing model with parameters such as "tR=50,tPROG=800": array
+ * read, program and erase times and the channel transfer time of a whole
+ * page in us, the queue depth qd, and ts=0 to ignore trace timestamps.
+ * chnl gives the channel of each bank, or NULL for the channels of
+ * config.h.  The model stays off if spec is NULL.
+ */
+int open_timing(const char *spec, const uint32_t *chnl)
+{
+    static const uint8_t dft_map[] = VST_BANK_MAP;
+
+    timing_on = 0;
+    if (spec == NULL)
+        return 0;
+
+    t_read = 50000;
+    t_prog = 800000;
+    t_erase = 3000000;
+    t_xfer = 80000;
+    qd = 32;
+    use_ts = 1;
+    if (parse_spec(spec))
+        return 1;
+
+    bank_free = (uint64_t *)calloc(geo.num_banks, sizeof(uint64_t));
+    bank_chnl = (uint32_t *)malloc(geo.num_banks * sizeof(uint32_t));
+    events = (struct tm_event *)malloc(qd * sizeof(struct tm_event));
+    if (bank_free == NULL || bank_chnl == NULL || events == NULL) {
+        close_timing();
+        return 1;
+    }
+    n_chnl = 0;
+    for (uint32_t i = 0; i < geo.num_banks; i++) {
+        if (chnl != NULL)
+            bank_chnl[i] = chnl[i];
+        else if (geo.num_banks == VST_NUM_BANKS)
+            bank_chnl[i] = dft_map[i] % VST_NUM_CHNLS;
+        else
+            bank_chnl[i] = i % VST_NUM_CHNLS;
+        if (bank_chnl[i] >= n_chnl)
+            n_chnl = bank_chnl[i] + 1;
+    }
+    chnl_free = (uint64_t *)calloc(n_chnl, sizeof(uint64_t));
+    if (chnl_free == NULL) {
+        close_timing();
+        return 1;
+    }
+
+    for (uint32_t i = 0; i < qd; i++)
+        events[i].next = (i + 1 < qd) ? i + 1 : WHEEL_NIL;
+    ev_free = 0;
+    for (uint32_t i = 0; i < WHEEL_SIZE; i++)
+        wheel[i] = WHEEL_NIL;
+    overflow = WHEEL_NIL;
+    ovf_min = UINT64_MAX;
+    wheel_cur = 0;
+    n_wheel = n_out = 0;
+    now = req_done = req_arrival = 0;
+    ts_base = ts_last = 0;
+    ts_seen = started = 0;
+    n_req = n_read = byte_read = byte_write = 0;
+    t_end = 0;
+    timing_on = 1;
+    return 0;
+}
+
+void close_timing(void)
+{
+    if (timing_on && n_req > 0) {
+        double span = (t_end > 0) ? t_end / 1e9 : 1e-9;
+
+        printf("----------Timing Results----------\n");
+        printf("Simulated time (s): %.6f\n", t_end / 1e9);
+        printf("Requests: %" PRIu64 " (%" PRIu64 " reads)\n", n_req, n_read);
+        printf("IOPS: %.0f\n", n_req / span);
+        printf("Read bandwidth (MB/s): %.2f\n",
+                byte_read / span / (1024 * 1024));
+        printf("Write bandwidth (MB/s): %.2f\n",
+                byte_write / span / (1024 * 1024));
+        printf("----------Timing Results----------\n");
+
+        res_begin("timing");
+        res_dbl("t_read_us", t_read / 1e3);
+        res_dbl("t_prog_us", t_prog / 1e3);
+        res_dbl("t_erase_us", t_erase / 1e3);
+        res_dbl("t_xfer_us", t_xfer / 1e3);
+        res_u64("qd", qd);
+        res_bool("ts", use_ts);
+        res_dbl("sim_time_s", t_end / 1e9);
+        res_dbl("iops", n_req / span);
+        res_dbl("read_mbps", byte_read / span / (1024 * 1024));
+        res_dbl("write_mbps", byte_write / span / (1024 * 1024));
+        res_end();
+    }
+    free(bank_free);
+    bank_free = NULL;
+    free(chnl_free);
+    chnl_free = NULL;
+    free(bank_chnl);
+    bank_chnl = NULL;
+    free(events);
+    events = NULL;
+    timing_on = 0;
+}
+
+/* Issue the next request, which arrives at trace time ts */
+void tm_submit(uint64_t ts)
+{
+    uint64_t arrival;
+
+    if (!timing_on)
+        return;
+    if (!started) {
+        memset(bank_free, 0, geo.num_banks * sizeof(uint64_t));
+        memset(chnl_free, 0, n_chnl * sizeof(uint64_t));
+        started = 1;
+    }
+    if (!use_ts)
+        ts = 0;
+    if (!ts_seen) {
+        ts_first = ts;
+        ts_seen = 1;
+    }
+    arrival = ts_base + (ts > ts_first ? ts - ts_first : 0);
+    if (arrival > ts_last)
+        ts_last = arrival;
+
+    /* in order, once there is a free slot */
+    if (arrival > now)
+        now = arrival;
+    while (wheel_peek() <= now)
+        wheel_pop();
+    if (n_out == qd) {
+        uint64_t t = wheel_pop();
+        if (t > now)
+            now = t;
+    }
+    /* without a timestamp a request arrives when it can be issued */
+    req_arrival = (use_ts && ts != 0) ? arrival : now;
+    req_done = now;
+}
+
+int tm_enabled(void)
+{
+    return timing_on;
+}
+
+/**
+ * Complete the request in progress and return its latency in ns, from its
+ * arrival so that the time it waited to be issued counts
+ */
+uint64_t tm_complete(uint32_t rw, uint64_t n_byte)
+{
+    uint32_t e;
+
+    if (!timing_on)
+        return 0;
+    n_req++;
+    if (rw) {
+        n_read++;
+        byte_read += n_byte;
+    } else {
+        byte_write += n_byte;
+    }
+    if (req_done > t_end)
+        t_end = req_done;
+
+    e = ev_free;
+    ev_free = events[e].next;
+    events[e].t = req_done;
+    wheel_put(e);
+    n_out++;
+    return req_done - req_arrival;
+}
+
+/* Later passes over the trace start after the previous one */
+void tm_rewind(void)
+{
+    if (!timing_on)
+        return;
+    ts_base = ts_last;
+    ts_seen = 0;
+}
+
+static inline uint64_t max_u64(uint64_t a, uint64_t b)
+{
+    return (a > b) ? a : b;
+}
+
+static inline uint64_t xfer_time(uint32_t n_sect)
+{
+    return t_xfer * n_sect / geo.sectors_per_page;
+}
+
+static inline void finish(uint32_t bank, uint64_t done)
+{
+    bank_free[bank] = done;
+    if (done > req_done)
+        req_done = done;
+}
+
+void tm_read_page(uint32_t bank, uint32_t n_sect)
+{
+    uint64_t *cf, t;
+
+    if (!timing_on)
+        return;
+    cf = &chnl_free[bank_chnl[bank]];
+    t = max_u64(now, bank_free[bank]) + t_read;
+    /* the bank holds the page until the channel takes it */
+    t = max_u64(t, *cf) + xfer_time(n_sect);
+    *cf = t;
+    finish(bank, t);
+}
+
+void tm_write_page(uint32_t bank, uint32_t n_sect)
+{
+    uint64_t *cf, t;
+
+    if (!timing_on)
+        return;
+    cf = &chnl_free[bank_chnl[bank]];
+    t = max_u64(max_u64(now, bank_free[bank]), *cf) + xfer_time(n_sect);
+    *cf = t;
+    finish(bank, t + t_prog);
+}
+
+void tm_copyback_page(uint32_t bank)
+{
+    if (!timing_on)
+        return;
+    finish(bank, max_u64(now, bank_free[bank]) + t_read + t_prog);
+}
+
+void tm_erase_block(uint32_t bank)
+{
+    if (!timing_on)
+        return;
+    finish(bank, max_u64(now, bank_free[bank]) + t_erase);
+}
@@ -0,0 +1,22 @@
+/**
+ * timing.h
+ * Authors: Yun-Sheng Chang
+ */
+
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <stdint.h>
+
+int open_timing(const char *spec, const uint32_t *chnl);
+void close_timing(void);
+void tm_submit(uint64_t ts);
+int tm_enabled(void);
+uint64_t tm_complete(uint32_t rw, uint64_t n_byte);
+void tm_rewind(void);
+void tm_read_page(uint32_t bank, uint32_t n_sect);
+void tm_write_page(uint32_t bank, uint32_t n_sect);
+void tm_copyback_page(uint32_t bank);
+void tm_erase_block(uint32_t bank);
+
+#endif // TIMING_H
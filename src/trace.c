@@ -0,0 +1,1375 @@
+/**
+ * trace.c
+ * Authors: Yun-Sheng Chang
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "trace.h"
+#include "synth.h"
+
+/* text traces count in 512-byte sectors */
+#define TRACE_BYTES_PER_SECTOR 512
+/* read buffer of the text trace reader; also the longest line accepted */
+#define TRACE_TEXT_BUF_SIZE (1 << 20)
+
+/* a source of trace entries */
+struct trace_src {
+    uint32_t (*read)(const struct trace_ent **ents);
+    void (*rewind)(void);
+    int (*seek)(uint64_t n);
+    void (*close)(void);
+};
+
+static const struct trace_src *src;
+
+/**
+ * Text traces are streamed through a ring of fixed-size chunks.  A reader
+ * thread parses the trace file into free chunks while the simulator consumes
+ * filled ones, so memory usage does not depend on the trace length.
+ */
+struct trace_chunk {
+    struct trace_ent ents[TRACE_CHUNK_SIZE];
+    uint32_t n;
+    int eof;
+};
+
+static FILE *fp_trace;
+static char *txt_buf;
+static size_t txt_pos, txt_len;
+static int txt_eof;
+static struct trace_chunk *ring;
+/* number of chunks filled by the reader and released by the simulator */
+static uint64_t head, tail;
+/* the whole trace fits in ring[0] and is never read again */
+static int resident;
+static int holding, end_of_pass;
+static int rewind_req, quit;
+static int reader_started;
+static pthread_t reader;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond_filled = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t cond_freed = PTHREAD_COND_INITIALIZER;
+
+/* binary traces are mapped and replayed in place */
+static uint8_t *map_base;
+static size_t map_len;
+static const struct trace_ent *map_ents;
+static uint64_t map_n, map_pos;
+
+/**
+ * Varint-encoded and version 1 traces are decoded chunk by chunk into
+ * dec_buf
+ */
+static struct trace_ent *dec_buf;
+static const uint8_t *dec_begin, *dec_end, *dec_pos;
+static const void *dec_idx;
+static uint64_t dec_interval;
+static uint32_t dec_ver;
+/* end LBA, timestamp and disk of the previously decoded request */
+static uint64_t dec_prev, dec_ts;
+static uint32_t dec_dev;
+
+/* text traces parsed up front */
+static struct trace_ent *mem_ents;
+
+/* parser of the text trace being read */
+typedef int (*parse_fn_t)(const char *p, const char *end, struct trace_ent *e);
+static parse_fn_t parse_fn;
+
+static inline int is_blank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+static const char *parse_u64(const char *p, const char *end, uint64_t *v)
+{
+    uint64_t x;
+
+    while (p < end && is_blank(*p))
+        p++;
+    if (p == end || (unsigned)(*p - '0') > 9)
+        return NULL;
+    x = 0;
+    while (p < end && (unsigned)(*p - '0') <= 9)
+        x = x * 10 + (uint64_t)(*p++ - '0');
+    *v = x;
+    return p;
+}
+
+/* Parse a 32-bit field, rejecting values that do not fit */
+static const char *parse_uint(const char *p, const char *end, uint32_t *v)
+{
+    uint64_t x;
+
+    if ((p = parse_u64(p, end, &x)) == NULL || x > UINT32_MAX)
+        return NULL;
+    *v = (uint32_t)x;
+    return p;
+}
+
+/* Parse a timestamp in seconds with up to nanosecond precision */
+static const char *parse_sec(const char *p, const char *end, uint64_t *ns)
+{
+    uint64_t frac;
+    int digits;
+
+    if ((p = parse_u64(p, end, ns)) == NULL)
+        return NULL;
+    *ns *= 1000000000ULL;
+    if (p < end && *p == '.') {
+        p++;
+        frac = 0;
+        for (digits = 0; p < end && (unsigned)(*p - '0') <= 9; p++) {
+            if (digits++ < 9)
+                frac = frac * 10 + (uint64_t)(*p - '0');
+        }
+        for (; digits < 9; digits++)
+            frac *= 10;
+        *ns += frac;
+    }
+    return p;
+}
+
+/**
+ * Parse one line of a text trace, "<timestamp> <dev> <lba> <sec_num> <rw>",
+ * without the trailing newline.  The timestamp is in seconds.  Returns 0 on
+ * success, -1 for a line to skip and 1 for a malformed line.  Hand-written
+ * because fscanf() is locale-aware and dominated the parsing time.
+ */
+static int parse_line_txt(const char *p, const char *end, struct trace_ent *e)
+{
+    const char *q;
+
+    while (p < end && is_blank(*p))
+        p++;
+    if (p == end)
+        return -1;
+    /* tolerate timestamps in other notations */
+    q = parse_sec(p, end, &e->ts);
+    if (q == NULL || (q < end && !is_blank(*q)))
+        e->ts = 0;
+    while (p < end && !is_blank(*p))
+        p++;
+    if ((p = parse_uint(p, end, &e->dev)) == NULL ||
+            (p = parse_uint(p, end, &e->lba)) == NULL ||
+            (p = parse_uint(p, end, &e->sec_num)) == NULL ||
+            (p = parse_uint(p, end, &e->rw)) == NULL)
+        return 1;
+    return 0;
+}
+
+static const char *skip_field(const char *p, const char *end)
+{
+    while (p < end && *p != ',')
+        p++;
+    return (p < end) ? p + 1 : NULL;
+}
+
+/**
+ * Parse one line of an MSRC trace,
+ * "Timestamp,Hostname,DiskNumber,Type,Offset,Size,ResponseTime", where the
+ * timestamp is a Windows filetime in 100 ns units and offset and size are
+ * in bytes.  Requests are widened to the sectors they touch.  Header lines
+ * and empty requests are skipped; requests past 2 TiB are malformed.
+ */
+static int parse_line_csv(const char *p, const char *end, struct trace_ent *e)
+{
+    uint64_t ts, off, size, first, last;
+    uint32_t dev;
+    int rw;
+
+    while (p < end && is_blank(*p))
+        p++;
+    if (p == end || (unsigned)(*p - '0') > 9)
+        return -1;
+
+    if ((p = parse_u64(p, end, &ts)) == NULL || p == end || *p++ != ',' ||
+            (p = skip_field(p, end)) == NULL ||
+            (p = parse_uint(p, end, &dev)) == NULL || p == end ||
+            *p++ != ',' || p == end)
+        return 1;
+    if (*p == 'R' || *p == 'r')
+        rw = 1;
+    else if (*p == 'W' || *p == 'w')
+        rw = 0;
+    else
+        return 1;
+    if ((p = skip_field(p, end)) == NULL ||
+            (p = parse_u64(p, end, &off)) == NULL || p == end ||
+            *p++ != ',' ||
+            (p = parse_u64(p, end, &size)) == NULL)
+        return 1;
+    if (size == 0)
+        return -1;
+
+    first = off / TRACE_BYTES_PER_SECTOR;
+    last = (off + size - 1) / TRACE_BYTES_PER_SECTOR;
+    /* sectors beyond 2 TiB do not fit in a trace entry */
+    if (off + size < off || last > UINT32_MAX)
+        return 1;
+    e->ts = ts * 100;
+    e->dev = dev;
+    e->lba = (uint32_t)first;
+    e->sec_num = (uint32_t)(last - first + 1);
+    e->rw = rw;
+    return 0;
+}
+
+/* Pick the parser of a text trace from its first line */
+static parse_fn_t sniff_text(int fd)
+{
+    char buf[4096];
+    ssize_t n;
+    char *nl;
+
+    n = pread(fd, buf, sizeof(buf), 0);
+    if (n <= 0)
+        return parse_line_txt;
+    nl = (char *)memchr(buf, '\n', n);
+    if (memchr(buf, ',', (nl != NULL) ? nl - buf : n) != NULL)
+        return parse_line_csv;
+    return parse_line_txt;
+}
+
+/* Read more of the trace file into txt_buf; returns 0 at end of file */
+static int refill_text(void)
+{
+    size_t n;
+
+    if (txt_eof || txt_len - txt_pos == TRACE_TEXT_BUF_SIZE)
+        return 0;
+    memmove(txt_buf, txt_buf + txt_pos, txt_len - txt_pos);
+    txt_len -= txt_pos;
+    txt_pos = 0;
+    n = fread(txt_buf + txt_len, 1, TRACE_TEXT_BUF_SIZE - txt_len, fp_trace);
+    txt_len += n;
+    if (n == 0)
+        txt_eof = 1;
+    return n > 0;
+}
+
+static void fill_chunk(struct trace_chunk *c)
+{
+    char *line, *nl;
+    int ret;
+
+    c->n = 0;
+    c->eof = 0;
+    while (c->n < TRACE_CHUNK_SIZE) {
+        line = txt_buf + txt_pos;
+        nl = (char *)memchr(line, '\n', txt_len - txt_pos);
+        if (nl == NULL) {
+            if (refill_text())
+                continue;
+            /* last line without newline, or a line longer than txt_buf */
+            if (txt_pos == txt_len ||
+                    txt_len - txt_pos == TRACE_TEXT_BUF_SIZE) {
+                c->eof = 1;
+                break;
+            }
+            line = txt_buf + txt_pos;
+            nl = txt_buf + txt_len;
+            txt_pos = txt_len;
+        } else {
+            txt_pos = nl - txt_buf + 1;
+        }
+
+        ret = parse_fn(line, nl, &c->ents[c->n]);
+        if (ret > 0) {
+            /* the trace ends at the first malformed line */
+            c->eof = 1;
+            break;
+        }
+        if (ret == 0)
+            c->n++;
+    }
+}
+
+static void reset_text(void)
+{
+    fseek(fp_trace, 0, SEEK_SET);
+    txt_pos = 0;
+    txt_len = 0;
+    txt_eof = 0;
+}
+
+static void *reader_main(void *arg)
+{
+    struct trace_chunk *c;
+
+    pthread_mutex_lock(&lock);
+    for (;;) {
+        while (!quit && head - tail == TRACE_RING_SIZE)
+            pthread_cond_wait(&cond_freed, &lock);
+        if (quit)
+            break;
+
+        /* the simulator never touches a chunk that is not filled yet */
+        c = &ring[head % TRACE_RING_SIZE];
+        pthread_mutex_unlock(&lock);
+        fill_chunk(c);
+        pthread_mutex_lock(&lock);
+        head++;
+        pthread_cond_signal(&cond_filled);
+
+        if (c->eof) {
+            /* park until the simulator starts the next pass */
+            while (!quit && !rewind_req)
+                pthread_cond_wait(&cond_freed, &lock);
+            if (quit)
+                break;
+            rewind_req = 0;
+            reset_text();
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+static void release_chunk(void)
+{
+    if (!holding)
+        return;
+
+    pthread_mutex_lock(&lock);
+    tail++;
+    holding = 0;
+    pthread_cond_signal(&cond_freed);
+    pthread_mutex_unlock(&lock);
+}
+
+static uint32_t text_read(const struct trace_ent **ents)
+{
+    struct trace_chunk *c;
+
+    if (end_of_pass) {
+        release_chunk();
+        return 0;
+    }
+
+    if (resident) {
+        end_of_pass = 1;
+        *ents = ring[0].ents;
+        return ring[0].n;
+    }
+
+    release_chunk();
+    pthread_mutex_lock(&lock);
+    while (head == tail)
+        pthread_cond_wait(&cond_filled, &lock);
+    pthread_mutex_unlock(&lock);
+
+    c = &ring[tail % TRACE_RING_SIZE];
+    holding = 1;
+    end_of_pass = c->eof;
+    *ents = c->ents;
+    return c->n;
+}
+
+static void text_rewind(void)
+{
+    end_of_pass = 0;
+    if (resident)
+        return;
+
+    release_chunk();
+    pthread_mutex_lock(&lock);
+    rewind_req = 1;
+    pthread_cond_signal(&cond_freed);
+    pthread_mutex_unlock(&lock);
+}
+
+static int text_seek(uint64_t n)
+{
+    /* text traces can only be read front to back */
+    return 1;
+}
+
+static void text_close(void)
+{
+    if (reader_started) {
+        pthread_mutex_lock(&lock);
+        quit = 1;
+        pthread_cond_signal(&cond_freed);
+        pthread_mutex_unlock(&lock);
+        pthread_join(reader, NULL);
+        reader_started = 0;
+    }
+    if (fp_trace != NULL) {
+        fclose(fp_trace);
+        fp_trace = NULL;
+    }
+    free(txt_buf);
+    txt_buf = NULL;
+    free(ring);
+    ring = NULL;
+}
+
+static const struct trace_src text_src = {
+    text_read, text_rewind, text_seek, text_close
+};
+
+static int text_open(const char *fname)
+{
+    fp_trace = fopen(fname, "r");
+    if (fp_trace == NULL)
+        return 1;
+    parse_fn = sniff_text(fileno(fp_trace));
+
+    ring = (struct trace_chunk *)malloc(TRACE_RING_SIZE * sizeof(*ring));
+    txt_buf = (char *)malloc(TRACE_TEXT_BUF_SIZE);
+    if (ring == NULL || txt_buf == NULL)
+        return 1;
+    txt_pos = 0;
+    txt_len = 0;
+    txt_eof = 0;
+    head = 0;
+    tail = 0;
+    holding = 0;
+    end_of_pass = 0;
+    rewind_req = 0;
+    quit = 0;
+
+    /* small traces are kept in memory and replayed without the reader */
+    fill_chunk(&ring[0]);
+    if (ring[0].eof) {
+        resident = 1;
+        fclose(fp_trace);
+        fp_trace = NULL;
+        free(txt_buf);
+        txt_buf = NULL;
+        return 0;
+    }
+    resident = 0;
+    head = 1;
+
+    if (pthread_create(&reader, NULL, reader_main, NULL) != 0)
+        return 1;
+    reader_started = 1;
+    return 0;
+}
+
+/* longest varint */
+#define VARINT_MAX_LEN 10
+/* longest encoding of one varint record: three 64-bit varints and a disk */
+#define VARINT_MAX_REC 40
+
+/**
+ * Version 1 traces have a shorter header, no timestamps or disk numbers in
+ * their records and a shorter index.  They are widened on the fly.
+ */
+#define TRACE_HDR_V1_SIZE 64
+
+struct trace_ent_v1 {
+    uint32_t lba, sec_num, rw;
+};
+
+struct trace_idx_v1 {
+    uint64_t off;
+    uint64_t prev_end;
+};
+
+static int check_hdr(const struct trace_hdr *hdr, uint64_t file_size)
+{
+    uint64_t data_size, idx_size, min_hdr, align;
+
+    if (memcmp(hdr->magic, TRACE_MAGIC, sizeof(hdr->magic)) != 0)
+        return 1;
+    if (hdr->version == 1) {
+        if (hdr->ent_size != sizeof(struct trace_ent_v1))
+            return 1;
+        min_hdr = TRACE_HDR_V1_SIZE;
+        align = sizeof(uint32_t);
+        idx_size = sizeof(struct trace_idx_v1);
+    } else if (hdr->version == TRACE_VERSION) {
+        if (hdr->ent_size != sizeof(struct trace_ent))
+            return 1;
+        min_hdr = sizeof(*hdr);
+        align = sizeof(uint64_t);
+        idx_size = sizeof(struct trace_idx);
+    } else {
+        return 1;
+    }
+    /* records are accessed in place and must stay aligned */
+    if (hdr->hdr_size < min_hdr || hdr->hdr_size % align ||
+            hdr->hdr_size > file_size)
+        return 1;
+
+    switch (hdr->encoding) {
+    case TRACE_ENC_RAW:
+        if (hdr->n_ent > (file_size - hdr->hdr_size) / hdr->ent_size)
+            return 1;
+        break;
+    case TRACE_ENC_VARINT:
+        if (hdr->idx_interval == 0 || hdr->idx_off < hdr->hdr_size ||
+                hdr->idx_off > file_size)
+            return 1;
+        /* every record takes at least two bytes */
+        data_size = hdr->idx_off - hdr->hdr_size;
+        if (hdr->n_ent > data_size / 2)
+            return 1;
+        if ((hdr->n_ent + hdr->idx_interval - 1) / hdr->idx_interval >
+                (file_size - hdr->idx_off) / idx_size)
+            return 1;
+        break;
+    default:
+        return 1;
+    }
+    return 0;
+}
+
+static uint32_t bin_read(const struct trace_ent **ents)
+{
+    uint64_t n;
+
+    n = map_n - map_pos;
+    if (n > TRACE_CHUNK_SIZE)
+        n = TRACE_CHUNK_SIZE;
+    *ents = &map_ents[map_pos];
+    map_pos += n;
+    return (uint32_t)n;
+}
+
+static void bin_rewind(void)
+{
+    map_pos = 0;
+}
+
+static int bin_seek(uint64_t n)
+{
+    if (n > map_n)
+        return 1;
+    map_pos = n;
+    return 0;
+}
+
+static void bin_close(void)
+{
+    if (map_base != NULL)
+        munmap(map_base, map_len);
+    map_base = NULL;
+    free(dec_buf);
+    dec_buf = NULL;
+}
+
+static const struct trace_src bin_src = {
+    bin_read, bin_rewind, bin_seek, bin_close
+};
+
+static uint32_t raw_v1_read(const struct trace_ent **ents)
+{
+    const struct trace_ent_v1 *e;
+    uint32_t n, i;
+
+    n = (map_n - map_pos > TRACE_CHUNK_SIZE) ?
+            TRACE_CHUNK_SIZE : (uint32_t)(map_n - map_pos);
+    e = (const struct trace_ent_v1 *)dec_begin + map_pos;
+    for (i = 0; i < n; i++) {
+        dec_buf[i].ts = 0;
+        dec_buf[i].lba = e[i].lba;
+        dec_buf[i].sec_num = e[i].sec_num;
+        dec_buf[i].rw = e[i].rw;
+        dec_buf[i].dev = 0;
+    }
+    map_pos += n;
+    *ents = dec_buf;
+    return n;
+}
+
+static const struct trace_src raw_v1_src = {
+    raw_v1_read, bin_rewind, bin_seek, bin_close
+};
+
+static inline uint64_t get_varint(const uint8_t **pp)
+{
+    const uint8_t *p = *pp;
+    uint64_t v;
+    int shift;
+
+    v = *p++;
+    if (v & 0x80) {
+        v &= 0x7f;
+        shift = 7;
+        do {
+            v |= (uint64_t)(*p & 0x7f) << shift;
+            shift += 7;
+        } while ((*p++ & 0x80) && shift < 64);
+    }
+    *pp = p;
+    return v;
+}
+
+/* Bounds-checked get_varint() for the tail of the data */
+static int get_varint_safe(const uint8_t **pp, const uint8_t *end,
+                           uint64_t *v)
+{
+    const uint8_t *p;
+
+    for (p = *pp; p < end && p - *pp < VARINT_MAX_LEN; p++) {
+        if (!(*p & 0x80)) {
+            *v = get_varint(pp);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static inline uint64_t unzigzag(uint64_t v)
+{
+    return (v >> 1) ^ -(v & 1);
+}
+
+/* Decode one record; the caller makes sure it is entirely in the buffer */
+static inline void get_ent(const uint8_t **pp, struct trace_ent *e)
+{
+    uint64_t len;
+
+    if (dec_ver > 1)
+        dec_ts += unzigzag(get_varint(pp));
+    dec_prev += unzigzag(get_varint(pp));
+    len = get_varint(pp);
+    if (dec_ver > 1 && (len & 2))
+        dec_dev = (uint32_t)get_varint(pp);
+
+    e->ts = dec_ts;
+    e->lba = (uint32_t)dec_prev;
+    e->sec_num = (uint32_t)(len >> (dec_ver > 1 ? 2 : 1));
+    e->rw = (uint32_t)(len & 1);
+    e->dev = dec_dev;
+    dec_prev = e->lba + (uint64_t)e->sec_num;
+}
+
+/* Bounds-checked get_ent(); fails on a truncated record */
+static int get_ent_safe(const uint8_t **pp, const uint8_t *end,
+                        struct trace_ent *e)
+{
+    const uint8_t *p;
+    uint64_t v;
+    int n_varint, i;
+
+    /* check that all varints of the record are complete, then decode it */
+    p = *pp;
+    n_varint = (dec_ver > 1) ? 3 : 2;
+    for (i = 0; i < n_varint; i++) {
+        if (get_varint_safe(&p, end, &v))
+            return 1;
+    }
+    if (dec_ver > 1 && (v & 2) && get_varint_safe(&p, end, &v))
+        return 1;
+    get_ent(pp, e);
+    return 0;
+}
+
+static uint32_t varint_read(const struct trace_ent **ents)
+{
+    const uint8_t *p;
+    uint32_t n, i;
+
+    n = (map_n - map_pos > TRACE_CHUNK_SIZE) ?
+            TRACE_CHUNK_SIZE : (uint32_t)(map_n - map_pos);
+    p = dec_pos;
+    if ((uint64_t)(dec_end - p) >= (uint64_t)n * VARINT_MAX_REC) {
+        for (i = 0; i < n; i++)
+            get_ent(&p, &dec_buf[i]);
+    } else {
+        /* a truncated trace simply ends early */
+        for (i = 0; i < n; i++) {
+            if (get_ent_safe(&p, dec_end, &dec_buf[i])) {
+                map_n = map_pos + i;
+                break;
+            }
+        }
+    }
+    dec_pos = p;
+    map_pos += i;
+    *ents = dec_buf;
+    return i;
+}
+
+static int varint_seek(uint64_t n)
+{
+    const struct trace_idx_v1 *idx_v1;
+    const struct trace_idx *idx;
+    struct trace_ent e;
+    uint64_t blk, off;
+
+    if (n > map_n)
+        return 1;
+    blk = n / dec_interval;
+    if (n == map_n && n % dec_interval == 0) {
+        /* no index entry past the last record */
+        map_pos = n;
+        return 0;
+    }
+    if (dec_ver > 1) {
+        idx = (const struct trace_idx *)dec_idx + blk;
+        off = idx->off;
+        dec_prev = idx->prev_end;
+        dec_ts = idx->prev_ts;
+        dec_dev = idx->prev_dev;
+    } else {
+        idx_v1 = (const struct trace_idx_v1 *)dec_idx + blk;
+        off = idx_v1->off;
+        dec_prev = idx_v1->prev_end;
+    }
+    if (off >= (uint64_t)(dec_end - dec_begin))
+        return 1;
+    dec_pos = dec_begin + off;
+
+    /* decode and drop the records before n within the block */
+    for (map_pos = blk * dec_interval; map_pos < n; map_pos++) {
+        if (get_ent_safe(&dec_pos, dec_end, &e))
+            return 1;
+    }
+    return 0;
+}
+
+static void varint_rewind(void)
+{
+    dec_pos = dec_begin;
+    dec_prev = 0;
+    dec_ts = 0;
+    dec_dev = 0;
+    map_pos = 0;
+}
+
+static const struct trace_src varint_src = {
+    varint_read, varint_rewind, varint_seek, bin_close
+};
+
+static int bin_open(int fd, uint64_t file_size)
+{
+    const struct trace_hdr *hdr;
+
+    if (file_size < TRACE_HDR_V1_SIZE)
+        return 1;
+    map_len = file_size;
+    map_base = (uint8_t *)mmap(NULL, map_len, PROT_READ, MAP_SHARED, fd, 0);
+    if (map_base == MAP_FAILED) {
+        map_base = NULL;
+        return 1;
+    }
+
+    hdr = (const struct trace_hdr *)map_base;
+    if (check_hdr(hdr, file_size)) {
+        bin_close();
+        return 1;
+    }
+    map_n = hdr->n_ent;
+    map_pos = 0;
+    posix_madvise(map_base, map_len, POSIX_MADV_SEQUENTIAL);
+
+    if (hdr->encoding == TRACE_ENC_RAW && hdr->version == TRACE_VERSION) {
+        map_ents = (const struct trace_ent *)(map_base + hdr->hdr_size);
+        src = &bin_src;
+        return 0;
+    }
+
+    dec_buf = (struct trace_ent *)malloc(TRACE_CHUNK_SIZE * sizeof(*dec_buf));
+    if (dec_buf == NULL) {
+        bin_close();
+        return 1;
+    }
+    dec_ver = hdr->version;
+    dec_begin = map_base + hdr->hdr_size;
+    if (hdr->encoding == TRACE_ENC_RAW) {
+        src = &raw_v1_src;
+        return 0;
+    }
+    dec_end = map_base + hdr->idx_off;
+    dec_idx = map_base + hdr->idx_off;
+    dec_interval = hdr->idx_interval;
+    varint_rewind();
+    src = &varint_src;
+    return 0;
+}
+
+/**
+ * Text traces can also be parsed up front by several threads.  The file is
+ * split into one slice per thread at line boundaries.  The threads first
+ * count the lines of their slices, which bounds the number of entries, and
+ * then parse their slices into disjoint parts of the output array.  The
+ * parts are finally compacted in order.
+ */
+struct parse_job {
+    const char *begin, *end;
+    struct trace_ent *ents;
+    uint64_t n;
+    int bad;
+};
+
+static void *count_main(void *arg)
+{
+    struct parse_job *job = (struct parse_job *)arg;
+    const char *p, *nl;
+
+    job->n = 0;
+    for (p = job->begin; p < job->end; p = nl + 1) {
+        nl = (const char *)memchr(p, '\n', job->end - p);
+        if (nl == NULL)
+            nl = job->end;
+        job->n++;
+    }
+    return NULL;
+}
+
+static void *parse_main(void *arg)
+{
+    struct parse_job *job = (struct parse_job *)arg;
+    const char *p, *nl;
+    int ret;
+
+    job->n = 0;
+    job->bad = 0;
+    for (p = job->begin; p < job->end; p = nl + 1) {
+        nl = (const char *)memchr(p, '\n', job->end - p);
+        if (nl == NULL)
+            nl = job->end;
+        ret = parse_fn(p, nl, &job->ents[job->n]);
+        if (ret > 0) {
+            job->bad = 1;
+            break;
+        }
+        if (ret == 0)
+            job->n++;
+    }
+    return NULL;
+}
+
+static void run_jobs(struct parse_job *jobs, pthread_t *tids, int n_job,
+                     void *(*fn)(void *))
+{
+    int i;
+
+    for (i = 1; i < n_job; i++) {
+        /* fall back to the calling thread if no thread can be created */
+        if (pthread_create(&tids[i], NULL, fn, &jobs[i]) != 0) {
+            fn(&jobs[i]);
+            tids[i] = pthread_self();
+        }
+    }
+    fn(&jobs[0]);
+    for (i = 1; i < n_job; i++) {
+        if (!pthread_equal(tids[i], pthread_self()))
+            pthread_join(tids[i], NULL);
+    }
+}
+
+static int parse_text_mt(int fd, uint64_t size, int n_thread,
+                         struct trace_ent **ents, uint64_t *n)
+{
+    struct parse_job *jobs;
+    pthread_t *tids;
+    const char *base, *p;
+    uint64_t total;
+    int i;
+
+    *ents = NULL;
+    *n = 0;
+    if (size == 0)
+        return 0;
+    if ((uint64_t)n_thread > size)
+        n_thread = (int)size;
+
+    base = (const char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED)
+        return 1;
+    jobs = (struct parse_job *)calloc(n_thread, sizeof(*jobs));
+    tids = (pthread_t *)calloc(n_thread, sizeof(*tids));
+    if (jobs == NULL || tids == NULL)
+        goto fail;
+
+    /* every slice but the first starts right after a newline */
+    for (i = 0; i < n_thread; i++) {
+        p = base + size * i / n_thread;
+        if (i > 0) {
+            p = (const char *)memchr(p - 1, '\n', base + size - (p - 1));
+            p = (p == NULL) ? base + size : p + 1;
+        }
+        jobs[i].begin = p;
+        if (i > 0)
+            jobs[i - 1].end = p;
+    }
+    jobs[n_thread - 1].end = base + size;
+
+    run_jobs(jobs, tids, n_thread, count_main);
+    total = 0;
+    for (i = 0; i < n_thread; i++)
+        total += jobs[i].n;
+    *ents = (struct trace_ent *)malloc((total ? total : 1) * sizeof(**ents));
+    if (*ents == NULL)
+        goto fail;
+    total = 0;
+    for (i = 0; i < n_thread; i++) {
+        jobs[i].ents = *ents + total;
+        total += jobs[i].n;
+    }
+
+    run_jobs(jobs, tids, n_thread, parse_main);
+    /* stitch the slices together; the trace ends at a malformed line */
+    for (i = 0; i < n_thread; i++) {
+        memmove(*ents + *n, jobs[i].ents, jobs[i].n * sizeof(**ents));
+        *n += jobs[i].n;
+        if (jobs[i].bad)
+            break;
+    }
+
+    free(tids);
+    free(jobs);
+    munmap((void *)base, size);
+    return 0;
+
+fail:
+    free(*ents);
+    *ents = NULL;
+    free(tids);
+    free(jobs);
+    munmap((void *)base, size);
+    return 1;
+}
+
+static void mem_close(void)
+{
+    free(mem_ents);
+    mem_ents = NULL;
+}
+
+static const struct trace_src mem_src = {
+    bin_read, bin_rewind, bin_seek, mem_close
+};
+
+static int mem_open(int fd, uint64_t file_size, int n_thread)
+{
+    parse_fn = sniff_text(fd);
+    if (parse_text_mt(fd, file_size, n_thread, &mem_ents, &map_n))
+        return 1;
+    map_ents = mem_ents;
+    map_pos = 0;
+    src = &mem_src;
+    return 0;
+}
+
+static int synth_seek(uint64_t n)
+{
+    /* synthetic workloads are generated front to back */
+    return 1;
+}
+
+static const struct trace_src synth_src = {
+    synth_read, synth_rewind, synth_seek, close_synth
+};
+
+/**
+ * Open a trace, parsing text traces with n_thread threads up front or, if
+ * n_thread is 0, streaming them through the reader thread.  Synthetic
+ * workloads must give their own LBA range here.
+ */
+static int open_src(const char *fname, int n_thread)
+{
+    char magic[sizeof(((struct trace_hdr *)0)->magic)];
+    struct stat st;
+    int fd, ret;
+
+    if (strncmp(fname, SYNTH_PREFIX, strlen(SYNTH_PREFIX)) == 0)
+        return open_trace_synth(fname, 0);
+
+    fd = open(fname, O_RDONLY);
+    if (fd < 0)
+        return 1;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return 1;
+    }
+
+    if (pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+            memcmp(magic, TRACE_MAGIC, sizeof(magic)) == 0) {
+        ret = bin_open(fd, st.st_size);
+    } else if (n_thread > 0) {
+        ret = mem_open(fd, st.st_size, n_thread);
+    } else {
+        ret = text_open(fname);
+        src = &text_src;
+    }
+    close(fd);
+    return ret;
+}
+
+/**
+ * Open a trace file for replay.  Binary traces are recognized by their
+ * magic number; anything else is parsed as a text trace.  Names starting
+ * with "synth:" denote synthetic workloads.
+ */
+int open_trace(const char *fname)
+{
+    return open_src(fname, 0);
+}
+
+/**
+ * Open the synthetic workload named by "synth:<spec>" over n_lba sectors,
+ * unless the spec gives its own range
+ */
+int open_trace_synth(const char *name, uint64_t n_lba)
+{
+    if (strncmp(name, SYNTH_PREFIX, strlen(SYNTH_PREFIX)) != 0 ||
+            open_synth(name + strlen(SYNTH_PREFIX), n_lba))
+        return 1;
+    src = &synth_src;
+    return 0;
+}
+
+static uint64_t hash_bytes(uint64_t h, const void *buf, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)buf;
+
+    /* FNV-1a */
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/**
+ * Open a trace through the parsed-trace cache in cache_dir.  The first
+ * process to open a text trace converts it into a binary trace in the
+ * cache; later and concurrent processes wait for that conversion and map
+ * the cached copy, so a sweep parses each trace once and all of its jobs
+ * share the page cache pages of the same file.  Cached copies are named
+ * after the real path, size and modification time of the trace, so a
+ * modified trace never hits a stale copy.
+ */
+int open_trace_cached(const char *fname, const char *cache_dir)
+{
+    char magic[sizeof(((struct trace_hdr *)0)->magic)];
+    struct flock fl;
+    struct stat st;
+    char *path, *cname, *lname;
+    const char *base;
+    uint64_t h;
+    uint32_t ver;
+    int fd, ret;
+
+    /* synthetic workloads need no parsing and binary traces no caching */
+    if (strncmp(fname, SYNTH_PREFIX, strlen(SYNTH_PREFIX)) == 0)
+        return open_trace(fname);
+    fd = open(fname, O_RDONLY);
+    if (fd < 0)
+        return 1;
+    ret = (pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+            memcmp(magic, TRACE_MAGIC, sizeof(magic)) == 0);
+    close(fd);
+    if (ret)
+        return open_trace(fname);
+
+    path = realpath(fname, NULL);
+    if (path == NULL || stat(path, &st) != 0) {
+        free(path);
+        return 1;
+    }
+    /* copies in an older format would lose information */
+    ver = TRACE_VERSION;
+    h = hash_bytes(0xcbf29ce484222325ULL, &ver, sizeof(ver));
+    h = hash_bytes(h, path, strlen(path));
+    h = hash_bytes(h, &st.st_size, sizeof(st.st_size));
+    h = hash_bytes(h, &st.st_mtim.tv_sec, sizeof(st.st_mtim.tv_sec));
+    h = hash_bytes(h, &st.st_mtim.tv_nsec, sizeof(st.st_mtim.tv_nsec));
+    base = strrchr(path, '/') + 1;
+
+    cname = (char *)malloc(strlen(cache_dir) + strlen(base) + 32);
+    lname = (char *)malloc(strlen(cache_dir) + strlen(base) + 40);
+    if (cname == NULL || lname == NULL) {
+        ret = 1;
+        goto out;
+    }
+    sprintf(cname, "%s/%s-%016" PRIx64 ".vstb", cache_dir, base, h);
+    sprintf(lname, "%s.lock", cname);
+
+    ret = open_src(cname, 0);
+    if (ret == 0)
+        goto out;
+
+    /* one process converts, the others block until it is done */
+    fd = open(lname, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+        goto out;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    while (fcntl(fd, F_SETLKW, &fl) != 0) {
+        if (errno != EINTR) {
+            close(fd);
+            goto out;
+        }
+    }
+    ret = open_src(cname, 0);
+    /* stream the conversion so memory does not grow with the trace */
+    if (ret != 0 && trace_convert(fname, cname, TRACE_ENC_RAW, 0) == 0)
+        ret = open_src(cname, 0);
+    fl.l_type = F_UNLCK;
+    fcntl(fd, F_SETLK, &fl);
+    close(fd);
+
+out:
+    free(lname);
+    free(cname);
+    free(path);
+    return ret;
+}
+
+void close_trace(void)
+{
+    if (src != NULL)
+        src->close();
+    src = NULL;
+}
+
+/**
+ * Return the number of entries in the next chunk of the current pass and
+ * point *ents to them; 0 means the pass is over.  The entries stay valid
+ * until the next call to trace_read() or trace_rewind().
+ */
+uint32_t trace_read(const struct trace_ent **ents)
+{
+    return src->read(ents);
+}
+
+/* Start the next pass; only valid once trace_read() has returned 0 */
+void trace_rewind(void)
+{
+    src->rewind();
+}
+
+/* Continue the current pass from the n-th entry; binary traces only */
+int trace_seek(uint64_t n)
+{
+    return src->seek(n);
+}
+
+static uint8_t *put_varint(uint8_t *p, uint64_t v)
+{
+    while (v >= 0x80) {
+        *p++ = (uint8_t)v | 0x80;
+        v >>= 7;
+    }
+    *p++ = (uint8_t)v;
+    return p;
+}
+
+static inline uint64_t zigzag(int64_t v)
+{
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+/**
+ * Append n entries to a varint-encoded trace.  Each request is stored as
+ * the zigzag-encoded distance of its timestamp from that of the previous
+ * request and of its LBA from the end of the previous request, followed by
+ * its length with a disk-changed bit and the rw bit in the lowest bits, and
+ * the disk number only if it changed.  Sequential runs on one disk thus
+ * cost little more than their inter-arrival times.
+ */
+static int put_varint_ents(FILE *fp, const struct trace_ent *ents, uint32_t n,
+                           struct trace_hdr *hdr, uint8_t *buf,
+                           struct trace_idx **idx, uint64_t *data_size,
+                           struct trace_ent *prev)
+{
+    struct trace_idx *tmp;
+    uint64_t n_idx, prev_end;
+    int dev_changed;
+    uint8_t *p;
+
+    p = buf;
+    prev_end = prev->lba + (uint64_t)prev->sec_num;
+    for (uint32_t i = 0; i < n; i++) {
+        if ((hdr->n_ent + i) % TRACE_IDX_INTERVAL == 0) {
+            n_idx = (hdr->n_ent + i) / TRACE_IDX_INTERVAL;
+            tmp = (struct trace_idx *)realloc(*idx,
+                    (n_idx + 1) * sizeof(**idx));
+            if (tmp == NULL)
+                return 1;
+            *idx = tmp;
+            memset(&(*idx)[n_idx], 0, sizeof(**idx));
+            (*idx)[n_idx].off = *data_size + (p - buf);
+            (*idx)[n_idx].prev_end = prev_end;
+            (*idx)[n_idx].prev_ts = prev->ts;
+            (*idx)[n_idx].prev_dev = prev->dev;
+        }
+        dev_changed = (ents[i].dev != prev->dev);
+        p = put_varint(p, zigzag((int64_t)(ents[i].ts - prev->ts)));
+        p = put_varint(p, zigzag((int64_t)ents[i].lba - (int64_t)prev_end));
+        p = put_varint(p, ((uint64_t)ents[i].sec_num << 2) |
+                (dev_changed << 1) | !!ents[i].rw);
+        if (dev_changed)
+            p = put_varint(p, ents[i].dev);
+        *prev = ents[i];
+        prev_end = ents[i].lba + (uint64_t)ents[i].sec_num;
+    }
+    if (fwrite(buf, 1, p - buf, fp) != (size_t)(p - buf))
+        return 1;
+    *data_size += p - buf;
+    return 0;
+}
+
+/**
+ * Write the trace in src_name to dst_name in the binary format with the
+ * given record encoding, parsing text traces with n_thread threads or, if
+ * n_thread is 0, streaming them in bounded memory.  The output only
+ * appears under dst_name once it is complete.  Must not be called while a
+ * trace is open for replay.
+ */
+int trace_convert(const char *src_name, const char *dst_name,
+                  uint32_t encoding, int n_thread)
+{
+    static const uint8_t pad[sizeof(uint64_t)];
+    const struct trace_ent *ents;
+    struct trace_hdr hdr;
+    struct trace_idx *idx;
+    struct trace_ent prev;
+    uint64_t end, data_size, n_idx;
+    uint8_t *buf;
+    char *tmp_name;
+    uint32_t n;
+    FILE *fp;
+    int fd, created, ret;
+
+    if (encoding != TRACE_ENC_RAW && encoding != TRACE_ENC_VARINT)
+        return 1;
+    if (open_src(src_name, n_thread > 0 ? n_thread : 0))
+        return 1;
+
+    fd = -1;
+    created = 0;
+    fp = NULL;
+    idx = NULL;
+    buf = NULL;
+    tmp_name = (char *)malloc(strlen(dst_name) + sizeof(".XXXXXX"));
+    if (tmp_name == NULL)
+        goto fail;
+    if (encoding == TRACE_ENC_VARINT) {
+        buf = (uint8_t *)malloc((size_t)TRACE_CHUNK_SIZE * VARINT_MAX_REC);
+        if (buf == NULL)
+            goto fail;
+    }
+    sprintf(tmp_name, "%s.XXXXXX", dst_name);
+    fd = mkstemp(tmp_name);
+    created = (fd >= 0);
+    /* mkstemp creates the file private to the owner */
+    if (created)
+        fchmod(fd, 0644);
+    fp = created ? fdopen(fd, "wb") : NULL;
+    if (fp == NULL)
+        goto fail;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+    hdr.version = TRACE_VERSION;
+    hdr.hdr_size = sizeof(hdr);
+    hdr.ent_size = sizeof(struct trace_ent);
+    hdr.bytes_per_sector = TRACE_BYTES_PER_SECTOR;
+    hdr.encoding = encoding;
+    if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+        goto fail;
+
+    data_size = 0;
+    memset(&prev, 0, sizeof(prev));
+    while ((n = trace_read(&ents)) > 0) {
+        if (encoding == TRACE_ENC_RAW) {
+            if (fwrite(ents, sizeof(*ents), n, fp) != n)
+                goto fail;
+        } else {
+            if (put_varint_ents(fp, ents, n, &hdr, buf, &idx,
+                    &data_size, &prev))
+                goto fail;
+        }
+        for (uint32_t i = 0; i < n; i++) {
+            end = (uint64_t)ents[i].lba + ents[i].sec_num;
+            if (end > 0 && end - 1 > hdr.max_lba)
+                hdr.max_lba = end - 1;
+            if (ents[i].rw)
+                hdr.n_read++;
+        }
+        if (hdr.n_ent == 0)
+            hdr.first_ts = ents[0].ts;
+        hdr.last_ts = ents[n - 1].ts;
+        hdr.n_ent += n;
+    }
+
+    if (encoding == TRACE_ENC_VARINT) {
+        /* the index follows the records, 8-byte aligned */
+        end = (sizeof(pad) - data_size % sizeof(pad)) % sizeof(pad);
+        if (fwrite(pad, 1, end, fp) != end)
+            goto fail;
+        hdr.idx_interval = TRACE_IDX_INTERVAL;
+        hdr.idx_off = hdr.hdr_size + data_size + end;
+        n_idx = (hdr.n_ent + TRACE_IDX_INTERVAL - 1) / TRACE_IDX_INTERVAL;
+        if (fwrite(idx, sizeof(*idx), n_idx, fp) != n_idx)
+            goto fail;
+    }
+
+    /* fill in the header now that the totals are known */
+    if (fseek(fp, 0, SEEK_SET) != 0 ||
+            fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+        goto fail;
+    ret = fclose(fp);
+    fp = NULL;
+    fd = -1;
+    if (ret != 0 || rename(tmp_name, dst_name) != 0)
+        goto fail;
+
+    close_trace();
+    free(idx);
+    free(buf);
+    free(tmp_name);
+    return 0;
+
+fail:
+    if (fp != NULL)
+        fclose(fp);
+    else if (fd >= 0)
+        close(fd);
+    if (created)
+        unlink(tmp_name);
+    close_trace();
+    free(idx);
+    free(buf);
+    free(tmp_name);
+    return 1;
+}
+
+/**
+ * Read the header of a binary trace; fails on text traces.  Fields missing
+ * in older versions are zero.
+ */
+int trace_read_hdr(const char *fname, struct trace_hdr *hdr)
+{
+    struct stat st;
+    int fd, ret;
+
+    fd = open(fname, O_RDONLY);
+    if (fd < 0)
+        return 1;
+    ret = 1;
+    memset(hdr, 0, sizeof(*hdr));
+    if (fstat(fd, &st) == 0 &&
+            pread(fd, hdr, sizeof(*hdr), 0) >= TRACE_HDR_V1_SIZE &&
+            !check_hdr(hdr, st.st_size)) {
+        if (hdr->version == 1)
+            memset((char *)hdr + TRACE_HDR_V1_SIZE, 0,
+                    sizeof(*hdr) - TRACE_HDR_V1_SIZE);
+        ret = 0;
+    }
+    close(fd);
+    return ret;
+}
@@ -0,0 +1,83 @@
+/**
+ * trace.h
+ * Authors: Yun-Sheng Chang
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+/* number of trace entries per chunk */
+#define TRACE_CHUNK_SIZE 65536
+/* number of chunks in flight between the reader thread and the simulator */
+#define TRACE_RING_SIZE 2
+
+/* binary trace format */
+#define TRACE_MAGIC "VSTTRACE"
+#define TRACE_VERSION 2
+
+/* record encodings of binary traces */
+#define TRACE_ENC_RAW 0
+#define TRACE_ENC_VARINT 1
+/* number of varint-encoded records between two index entries */
+#define TRACE_IDX_INTERVAL 4096
+
+/* trace struct; also the on-disk record of raw binary traces */
+struct trace_ent {
+    /* issue time in ns, relative to an arbitrary epoch */
+    uint64_t ts;
+    uint32_t lba, sec_num, rw;
+    /* disk number of the request in the original trace */
+    uint32_t dev;
+};
+
+/**
+ * Header of binary traces, followed by n_ent records and, for encoded
+ * traces, the index at idx_off
+ */
+struct trace_hdr {
+    char magic[8];
+    uint32_t version;
+    uint32_t hdr_size;
+    uint32_t ent_size;
+    /* geometry hints */
+    uint32_t bytes_per_sector;
+    uint64_t max_lba;
+    uint64_t n_ent;
+    uint64_t n_read;
+    uint32_t encoding;
+    uint32_t idx_interval;
+    uint64_t idx_off;
+    /* since version 2: timestamps of the first and the last request */
+    uint64_t first_ts;
+    uint64_t last_ts;
+};
+
+/**
+ * Index entry of varint-encoded traces, one every idx_interval records.
+ * Gives the offset of the record from the first record and the end LBA,
+ * timestamp and disk number of the request before it, from which the
+ * record's deltas are decoded.  Version 1 traces only store off and
+ * prev_end.
+ */
+struct trace_idx {
+    uint64_t off;
+    uint64_t prev_end;
+    uint64_t prev_ts;
+    uint32_t prev_dev;
+    uint32_t pad;
+};
+
+int open_trace(const char *fname);
+int open_trace_cached(const char *fname, const char *cache_dir);
+int open_trace_synth(const char *name, uint64_t n_lba);
+void close_trace(void);
+uint32_t trace_read(const struct trace_ent **ents);
+void trace_rewind(void);
+int trace_seek(uint64_t n);
+int trace_convert(const char *src, const char *dst, uint32_t encoding,
+                  int n_thread);
+int trace_read_hdr(const char *fname, struct trace_hdr *hdr);
+
+#endif // TRACE_H
@@ -16,6 +16,7 @@
 #include "logger.h"
 #include "checker.h"
 #include "stat.h"
+#include "timing.h"
 
 #define VST_UNKNOWN_CONTENT ((uint32_t)-1)
 
@@ -23,100 +24,266 @@
 static flash_t flash;
 
 /* macro functions */
-#define get_page(bank, blk, page) \
-        (flash.banks[(bank)].blocks[(blk)].pages[(page)])
+#define get_block(bank, blk) \
+        (flash.blocks[(bank) * geo.blocks_per_bank + (blk)])
+#define page_words() ((geo.pages_per_block + 63) / 64)
+
+static inline int test_bit(const uint64_t *map, uint32_t i)
+{
+    return (map[i / 64] >> (i % 64)) & 1;
+}
+
+static inline void set_bit(uint64_t *map, uint32_t i)
+{
+    map[i / 64] |= (uint64_t)1 << (i % 64);
+}
+
+static inline void clear_bit(uint64_t *map, uint32_t i)
+{
+    map[i / 64] &= ~((uint64_t)1 << (i % 64));
+}
+
+/* Return the block for programming, allocating it on first use */
+static flash_block_t *alloc_block(uint32_t bank, uint32_t blk)
+{
+    flash_block_t *bp = get_block(bank, blk);
+
+    uint32_t n = geo.pages_per_block;
+
+    if (bp == NULL) {
+        /* the arrays follow the block, widest elements first */
+        bp = (flash_block_t *)calloc(1, sizeof(flash_block_t) +
+                n * (sizeof(uint8_t *) + sizeof(vpage_tag_t) +
+                sizeof(uint32_t)) + 2 * page_words() * sizeof(uint64_t));
+        if (bp == NULL) {
+            fprintf(stderr, "Fail allocating flash block.\n");
+            abort();
+        }
+        bp->data = (uint8_t **)(bp + 1);
+        bp->tagged = (uint64_t *)(bp->data + n);
+        bp->irregular = bp->tagged + page_words();
+        bp->tags = (vpage_tag_t *)(bp->irregular + page_words());
+        bp->page_epoch = (uint32_t *)(bp->tags + n);
+        bp->epoch = 1;
+        get_block(bank, blk) = bp;
+    }
+    return bp;
+}
+
+static inline int is_programmed(const flash_block_t *bp, uint32_t page)
+{
+    return bp != NULL && bp->page_epoch[page] == bp->epoch;
+}
+
+/* Drop the data left in a stale page */
+static inline void drop_data(flash_block_t *bp, uint32_t page)
+{
+    vpage_free_data(bp->data[page]);
+    bp->data[page] = NULL;
+    bp->n_data--;
+}
+
+/* Keep the LBAs of a host data page, compactly unless irregular */
+static void set_lbas(flash_block_t *bp, uint32_t page, const uint32_t *lbas)
+{
+    if (vpage_pack_lbas(&bp->tags[page], lbas) == 0) {
+        clear_bit(bp->irregular, page);
+        return;
+    }
+    if (bp->spill == NULL) {
+        bp->spill = (uint32_t *)malloc((uint64_t)geo.pages_per_block *
+                geo.sectors_per_page * sizeof(uint32_t));
+        if (bp->spill == NULL) {
+            fprintf(stderr, "Fail allocating flash block.\n");
+            abort();
+        }
+    }
+    memcpy(&bp->spill[page * geo.sectors_per_page], lbas,
+            geo.sectors_per_page * sizeof(uint32_t));
+    set_bit(bp->irregular, page);
+}
+
+/* Return the LBAs of a host data page, using buf if they are packed */
+static const uint32_t *get_lbas(const flash_block_t *bp, uint32_t page,
+                                uint32_t *buf)
+{
+    if (test_bit(bp->irregular, page))
+        return &bp->spill[page * geo.sectors_per_page];
+    vpage_unpack_lbas(buf, &bp->tags[page]);
+    return buf;
+}
 
 /* public interfaces */
 /* flash memory APIs */
 void vst_read_page(uint32_t bank, uint32_t blk, uint32_t page,
                uint32_t sect, uint32_t n_sect, uint64_t dram_addr)
 {
-    record(LOG_FLASH, "R: flash(%u, %u, %u, %u, %u) -> mem[0x%lx] + sec[%u]\n",
-            bank, blk, page, sect, n_sect, dram_addr, sect);
-    inc_flash_read(1);
+    record_event(EV_FLASH_READ, bank, blk, page, sect, n_sect, dram_addr);
 
-    assert(bank < VST_NUM_BANKS);
-    assert(blk < VST_BLOCKS_PER_BANK);
-    assert(page < VST_PAGES_PER_BLOCK);
+    assert(bank < geo.num_banks);
+    assert(blk < geo.blocks_per_bank);
+    assert(page < geo.pages_per_block);
+    inc_flash_read(bank);
+    tm_read_page(bank, n_sect);
 
-    flash_page_t *pp = &get_page(bank, blk, page);
+    flash_block_t *bp = get_block(bank, blk);
+    uint32_t lbas[VST_MAX_SECTORS_PER_PAGE];
 
-    vpage_copy(vram_vpage_map(dram_addr), &pp->vpage, sect, n_sect);
+    if (!is_programmed(bp, page))
+        vpage_load(vram_vpage_map(dram_addr), 0, NULL, NULL, sect, n_sect);
+    else if (test_bit(bp->tagged, page))
+        vpage_load(vram_vpage_map(dram_addr), 1, get_lbas(bp, page, lbas),
+                NULL, sect, n_sect);
+    else
+        vpage_load(vram_vpage_map(dram_addr), 0, NULL, bp->data[page],
+                sect, n_sect);
 }
 
 void vst_write_page(uint32_t bank, uint32_t blk, uint32_t page,
                 uint32_t sect, uint32_t n_sect, uint64_t dram_addr)
 {
-    record(LOG_FLASH, "W: mem[0x%lx] + sec[%u] -> flash(%u, %u, %u, %u, %u)\n",
-            dram_addr, sect, bank, blk, page, sect, n_sect);
-    inc_flash_write(1);
+    record_event(EV_FLASH_WRITE, bank, blk, page, sect, n_sect, dram_addr);
 
-    assert(bank < VST_NUM_BANKS);
-    assert(blk < VST_BLOCKS_PER_BANK);
-    assert(page < VST_PAGES_PER_BLOCK);
+    assert(bank < geo.num_banks);
+    assert(blk < geo.blocks_per_bank);
+    assert(page < geo.pages_per_block);
+    tm_write_page(bank, n_sect);
 
-    chk_non_seq_write(&flash, bank, blk, page);
+    chk_non_seq_write(bank, blk, page);
 
-    chk_overwrite(&flash, bank, blk, page);
+    chk_overwrite(bank, blk, page);
 
-    flash_page_t *pp = &get_page(bank, blk, page);
-    pp->is_erased = 0;
-    vpage_copy(&pp->vpage, vram_vpage_map(dram_addr), sect, n_sect);
+    flash_block_t *bp = alloc_block(bank, blk);
+    vpage_t *pp = vram_vpage_map(dram_addr);
+    uint32_t lbas[VST_MAX_SECTORS_PER_PAGE];
+    int tagged;
+    bp->page_epoch[page] = bp->epoch;
+    /* metadata gets a data buffer, reusing any left in the page */
+    bp->n_data -= (bp->data[page] != NULL);
+    tagged = vpage_store(pp, lbas, &bp->data[page], sect, n_sect);
+    bp->n_data += (bp->data[page] != NULL);
+    if (tagged) {
+        set_bit(bp->tagged, page);
+        set_lbas(bp, page, lbas);
+        if (bp->data[page] != NULL)
+            drop_data(bp, page);
+    } else {
+        clear_bit(bp->tagged, page);
+    }
+    /* host data not from the write buffer is being relocated */
+    if (vram_in_wbuf(pp))
+        inc_flash_write(bank, STAT_HOST, vram_take_host_sect(pp));
+    else
+        inc_flash_write(bank, test_bit(bp->tagged, page) ?
+                STAT_GC : STAT_META, 0);
 }
 
 void vst_copyback_page(uint32_t bank, uint32_t blk_src, uint32_t page_src,
                    uint32_t blk_dst, uint32_t page_dst)
 {
-    record(LOG_FLASH, "CB: flash(%u, %u, %u) -> flash(%u, %u, %u)\n",
-            bank, blk_src, page_src,
-            bank, blk_dst, page_dst);
-    inc_flash_cb(1);
-
-    assert(bank < VST_NUM_BANKS);
-    assert(blk_src < VST_BLOCKS_PER_BANK);
-    assert(page_src < VST_PAGES_PER_BLOCK);
-    assert(blk_dst < VST_BLOCKS_PER_BANK);
-    assert(page_dst < VST_PAGES_PER_BLOCK);
-
-    chk_overwrite(&flash, bank, blk_dst, page_dst);
-
-    flash_page_t *pp_dst, *pp_src;
-    pp_dst = &get_page(bank, blk_dst, page_dst);
-    pp_src = &get_page(bank, blk_src, page_src);
-    pp_dst->is_erased = 0;
-    vpage_copy(&pp_dst->vpage, &pp_src->vpage, 0, VST_SECTORS_PER_PAGE);
+    record_event(EV_FLASH_COPYBACK, bank, blk_src, page_src, 0, 0,
+            (uint64_t)blk_dst << 32 | page_dst);
+
+    assert(bank < geo.num_banks);
+    assert(blk_src < geo.blocks_per_bank);
+    assert(page_src < geo.pages_per_block);
+    assert(blk_dst < geo.blocks_per_bank);
+    assert(page_dst < geo.pages_per_block);
+    tm_copyback_page(bank);
+
+    chk_overwrite(bank, blk_dst, page_dst);
+
+    flash_block_t *bp_dst, *bp_src;
+    bp_dst = alloc_block(bank, blk_dst);
+    bp_src = get_block(bank, blk_src);
+    bp_dst->page_epoch[page_dst] = bp_dst->epoch;
+    if (is_programmed(bp_src, page_src) &&
+            test_bit(bp_src->tagged, page_src)) {
+        /* host data */
+        uint32_t lbas[VST_MAX_SECTORS_PER_PAGE];
+        set_bit(bp_dst->tagged, page_dst);
+        set_lbas(bp_dst, page_dst, get_lbas(bp_src, page_src, lbas));
+        if (bp_dst->data[page_dst] != NULL)
+            drop_data(bp_dst, page_dst);
+        inc_flash_cb(bank, STAT_GC);
+        return;
+    }
+
+    /* metadata; an erased source stays erased */
+    clear_bit(bp_dst->tagged, page_dst);
+    if (!is_programmed(bp_src, page_src) || bp_src->data[page_src] == NULL) {
+        if (bp_dst->data[page_dst] != NULL)
+            drop_data(bp_dst, page_dst);
+        /* merges also copy the unwritten pages of a block */
+        inc_flash_cb(bank, STAT_GC);
+        return;
+    }
+    inc_flash_cb(bank, vpage_is_blank(bp_src->data[page_src]) ?
+            STAT_GC : STAT_META);
+    /* the source stays intact until erased, so both pages share it */
+    if (bp_dst->data[page_dst] != NULL)
+        drop_data(bp_dst, page_dst);
+    bp_dst->data[page_dst] = vpage_share_data(bp_src->data[page_src]);
+    bp_dst->n_data++;
 }
 
 void vst_erase_block(uint32_t bank, uint32_t blk)
 {
-    record(LOG_FLASH, "E: flash(%u, %u)\n", bank, blk);
-    inc_flash_erase(1);
-
-    for (uint32_t i = 0; i < VST_PAGES_PER_BLOCK; i++) {
-        flash_page_t *pp;
-        pp = &get_page(bank, blk, i);
-        pp->is_erased = 1;
-        vpage_free(&pp->vpage);
+    record_event(EV_FLASH_ERASE, bank, blk, 0, 0, 0, 0);
+
+    assert(bank < geo.num_banks);
+    assert(blk < geo.blocks_per_bank);
+    inc_flash_erase(bank, blk);
+    tm_erase_block(bank);
+
+    chk_erase(bank, blk);
+
+    flash_block_t *bp = get_block(bank, blk);
+    if (bp == NULL)
+        return;
+    bp->epoch++;
+    /* return the buffers of the erased pages to the pool */
+    for (uint32_t i = 0; bp->n_data > 0 && i < geo.pages_per_block; i++) {
+        if (bp->data[i] != NULL)
+            drop_data(bp, i);
     }
+    assert(bp->n_data == 0);
+    free(bp->spill);
+    bp->spill = NULL;
+}
+
+int flash_is_erased(uint32_t bank, uint32_t blk, uint32_t page)
+{
+    return !is_programmed(get_block(bank, blk), page);
 }
 
 int open_flash(void)
 {
-    uint32_t i, j, k;
-
-    for (i = 0; i < VST_NUM_BANKS; i++) {
-        for (j = 0; j < VST_BLOCKS_PER_BANK; j++) {
-            for (k = 0; k < VST_PAGES_PER_BLOCK; k++) {
-                flash_page_t *pp = &get_page(i, j, k);
-                pp->is_erased = 1;
-                vpage_init(&pp->vpage, NULL);
-            }
-        }
-    }
+    /* all blocks start erased and unallocated */
+    flash.blocks = (flash_block_t **)calloc(geo.num_blocks,
+            sizeof(flash_block_t *));
+    if (flash.blocks == NULL)
+        return 1;
     record(LOG_FLASH, "Virtual flash initialized\n");
     return 0;
 }
 
 void close_flash(void)
 {
+    if (flash.blocks == NULL)
+        return;
+    for (uint32_t i = 0; i < geo.num_banks; i++) {
+        for (uint32_t j = 0; j < geo.blocks_per_bank; j++) {
+            flash_block_t *bp = get_block(i, j);
+            if (bp == NULL)
+                continue;
+            for (uint32_t k = 0; k < geo.pages_per_block; k++)
+                vpage_free_data(bp->data[k]);
+            free(bp->spill);
+            free(bp);
+        }
+    }
+    free(flash.blocks);
+    flash.blocks = NULL;
+    close_vpage_pool();
 }
@@ -8,23 +8,36 @@
 
 #include <stdint.h>
 #include "config.h"
+#include "geometry.h"
 #include "vpage.h"
 
+/**
+ * Page state is kept in per-block arrays, one bit or entry per page.  A page
+ * is programmed only if it was programmed in the current erase epoch of its
+ * block, so erasing a block just starts a new epoch.  Tags of stale pages
+ * are left behind, while their data buffers and spilled LBAs go back on
+ * erase.  The arrays are sized by the geometry and follow the block in the
+ * same allocation.
+ */
 typedef struct {
-    uint8_t is_erased;
-    vpage_t vpage;
-} flash_page_t;
-
-typedef struct {
-    flash_page_t pages[VST_PAGES_PER_BLOCK];
+    uint32_t epoch;
+    /* pages holding a data buffer, so erasing needs no scan without any */
+    uint32_t n_data;
+    uint32_t *page_epoch;
+    /* host data pages, identified by the LBAs of their sectors */
+    uint64_t *tagged;
+    /* host data pages whose LBAs are kept in full in spill */
+    uint64_t *irregular;
+    /* metadata pages; NULL until first programmed */
+    uint8_t **data;
+    vpage_tag_t *tags;
+    /* sectors_per_page LBAs per page; allocated on the first irregular page */
+    uint32_t *spill;
 } flash_block_t;
 
+/* blocks are allocated on first program; NULL blocks are erased */
 typedef struct {
-    flash_block_t blocks[VST_BLOCKS_PER_BANK];
-} flash_bank_t;
-
-typedef struct {
-    flash_bank_t banks[VST_NUM_BANKS];
+    flash_block_t **blocks;
 } flash_t;
 
 /* flash memory APIs */
@@ -36,6 +49,8 @@ void vst_copyback_page(uint32_t bank, uint32_t blk_src, uint32_t page_src,
                    uint32_t blk_dst, uint32_t page_dst);
 void vst_erase_block(uint32_t bank, uint32_t blk);
 
+int flash_is_erased(uint32_t bank, uint32_t blk, uint32_t page);
+
 int open_flash(void);
 void close_flash(void);
 
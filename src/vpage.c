@@ -3,13 +3,389 @@
  * Authors: Yun-Sheng Chang
  */
 
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include "config.h"
 #include "vpage.h"
 
+/**
+ * Page data buffers come from a pool of fixed-size buffers.  The pool
+ * reserves address space for the largest possible number of buffers up
+ * front and backs it with memory 2 MB slab by slab, using huge pages where
+ * possible, so a buffer and its index convert into each other by
+ * arithmetic.  Free buffers form a lock-free stack linked through their
+ * first word by buffer index.  The head holds the index of the top buffer
+ * plus one in its low half and a tag in its high half that changes on
+ * every update, so a pop cannot succeed on a head that was popped and
+ * pushed back in between.  Slabs are only returned to the system by
+ * close_vpage_pool().
+ *
+ * Buffers are reference counted so that flash pages and DRAM pages can
+ * share an immutable payload.  A shared buffer must not be modified; the
+ * buffer returns to the pool when its last reference is dropped.
+ *
+ * Whole pages stored to flash are deduplicated by content.  Pages that are
+ * entirely 0xff or zero, such as freshly cleared bitmaps, share one
+ * canonical buffer per pattern.  With VST_DEDUP defined, any other payload
+ * is looked up in a hash table of stored payloads as well, at the cost of
+ * hashing every page stored.
+ */
+#define VPAGE_SLAB_SIZE (2 << 20)
+
+/* sized by the geometry on first use; a slab is a whole number of buffers */
+static uint32_t slab_pages, max_slabs;
+static uint64_t slab_size, pool_size;
+static uint8_t *pool_base;
+static uint32_t *pool_ref;
+static uint32_t n_slab;
+static uint64_t pool_head;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+uint32_t n_shared_pages;
+
+/* canonical payloads, holding a reference of their own */
+static uint8_t *fill_ff, *fill_00;
+
+#ifdef VST_DEDUP
+#define DEDUP_BUCKETS (1 << 20)
+
+/* chains of buffer indices plus one, linked through dedup_next */
+static uint32_t dedup_head[DEDUP_BUCKETS];
+/* per buffer, allocated with pool_ref */
+static uint32_t *dedup_next;
+static uint32_t *dedup_hash;
+static uint8_t *dedup_in;
+static pthread_mutex_t dedup_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void dedup_remove(uint32_t idx);
+#endif
+
+static inline uint8_t *pool_buf(uint32_t idx)
+{
+    return pool_base + (uint64_t)idx * geo.bytes_per_page;
+}
+
+static inline uint32_t pool_idx(const uint8_t *data)
+{
+    assert(data >= pool_base && data < pool_base + n_slab * slab_size);
+    return (uint32_t)geo_page((uint64_t)(data - pool_base));
+}
+
+static void pool_push(uint32_t idx)
+{
+    uint64_t old, new;
+
+    old = __atomic_load_n(&pool_head, __ATOMIC_ACQUIRE);
+    do {
+        __atomic_store_n((uint32_t *)pool_buf(idx), (uint32_t)old,
+                __ATOMIC_RELAXED);
+        new = ((old >> 32) + 1) << 32 | (idx + 1);
+    } while (!__atomic_compare_exchange_n(&pool_head, &old, new, 1,
+            __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+}
+
+/* Return the index of a free buffer plus one, or 0 if the pool is empty */
+static uint32_t pool_pop(void)
+{
+    uint64_t old, new;
+    uint32_t top, next;
+
+    old = __atomic_load_n(&pool_head, __ATOMIC_ACQUIRE);
+    do {
+        top = (uint32_t)old;
+        if (top == 0)
+            return 0;
+        /* may read a buffer popped meanwhile; the CAS then fails */
+        next = __atomic_load_n((uint32_t *)pool_buf(top - 1),
+                __ATOMIC_RELAXED);
+        new = ((old >> 32) + 1) << 32 | next;
+    } while (!__atomic_compare_exchange_n(&pool_head, &old, new, 1,
+            __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+    return top;
+}
+
+/* Size the pool by the geometry and reserve its address space */
+static int pool_init(void)
+{
+    uint8_t *p;
+    uint64_t n_buf;
+
+    slab_pages = VPAGE_SLAB_SIZE / geo.bytes_per_page;
+    if (slab_pages == 0)
+        slab_pages = 1;
+    slab_size = (uint64_t)slab_pages * geo.bytes_per_page;
+    /* every flash page holds at most one buffer */
+    max_slabs = (uint32_t)(geo.num_pages / slab_pages + 1);
+    pool_size = max_slabs * slab_size;
+    n_buf = (uint64_t)max_slabs * slab_pages;
+
+    pool_ref = (uint32_t *)calloc(n_buf, sizeof(uint32_t));
+#ifdef VST_DEDUP
+    dedup_next = (uint32_t *)calloc(n_buf, sizeof(uint32_t));
+    dedup_hash = (uint32_t *)calloc(n_buf, sizeof(uint32_t));
+    dedup_in = (uint8_t *)calloc(n_buf, sizeof(uint8_t));
+    if (dedup_next == NULL || dedup_hash == NULL || dedup_in == NULL)
+        return 1;
+#endif
+    if (pool_ref == NULL)
+        return 1;
+    p = (uint8_t *)mmap(NULL, pool_size, PROT_NONE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED)
+        return 1;
+    pool_base = p;
+    return 0;
+}
+
+/* Back one more slab with memory; returns 1 if the pool is exhausted */
+static int pool_grow(void)
+{
+    uint8_t *slab, *p;
+    int ret;
+
+    pthread_mutex_lock(&pool_lock);
+    ret = 1;
+    /* another thread may have refilled the pool */
+    if ((uint32_t)__atomic_load_n(&pool_head, __ATOMIC_ACQUIRE) != 0) {
+        ret = 0;
+        goto out;
+    }
+    if (pool_base == NULL && pool_init())
+        goto out;
+    if (n_slab == max_slabs)
+        goto out;
+
+    slab = pool_base + n_slab * slab_size;
+    p = MAP_FAILED;
+#if defined(VST_HUGE_PAGES) && defined(MAP_HUGETLB)
+    /* reserved huge pages, if the system has any */
+    if (slab_size == VPAGE_SLAB_SIZE)
+        p = (uint8_t *)mmap(slab, slab_size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_HUGETLB, -1, 0);
+#endif
+    if (p == MAP_FAILED) {
+        p = (uint8_t *)mmap(slab, slab_size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+        if (p == MAP_FAILED)
+            goto out;
+#ifdef MADV_HUGEPAGE
+        /* transparent huge pages otherwise */
+        madvise(p, slab_size, MADV_HUGEPAGE);
+#endif
+    }
+    for (uint32_t i = slab_pages; i > 0; i--)
+        pool_push(n_slab * slab_pages + i - 1);
+    n_slab++;
+    ret = 0;
+out:
+    pthread_mutex_unlock(&pool_lock);
+    return ret;
+}
+
+/* Allocate the data buffer of a page, holding one reference */
+uint8_t *vpage_alloc_data(void)
+{
+    uint32_t top;
+
+    while ((top = pool_pop()) == 0) {
+        if (pool_grow()) {
+            fprintf(stderr, "Fail allocating page data.\n");
+            abort();
+        }
+    }
+    __atomic_store_n(&pool_ref[top - 1], 1, __ATOMIC_RELAXED);
+    return pool_buf(top - 1);
+}
+
+/* Take another reference to a buffer */
+uint8_t *vpage_share_data(uint8_t *data)
+{
+    __atomic_fetch_add(&pool_ref[pool_idx(data)], 1, __ATOMIC_RELAXED);
+    return data;
+}
+
+/* Drop a reference to a buffer */
+void vpage_free_data(uint8_t *data)
+{
+    uint32_t idx;
+
+    if (data == NULL)
+        return;
+    idx = pool_idx(data);
+    if (__atomic_sub_fetch(&pool_ref[idx], 1, __ATOMIC_ACQ_REL) == 0) {
+#ifdef VST_DEDUP
+        dedup_remove(idx);
+#endif
+        pool_push(idx);
+    }
+}
+
+/* Make a buffer private to its holder before modifying it */
+static void own_data(uint8_t **data)
+{
+    if (*data != NULL &&
+            __atomic_load_n(&pool_ref[pool_idx(*data)], __ATOMIC_ACQUIRE) > 1) {
+        vpage_free_data(*data);
+        *data = NULL;
+    }
+    if (*data == NULL)
+        *data = vpage_alloc_data();
+#ifdef VST_DEDUP
+    else
+        dedup_remove(pool_idx(*data));
+#endif
+}
+
+/* Whether a page consists of byte c only */
+static int is_filled(const uint8_t *p, uint8_t c)
+{
+    const uint64_t *w = (const uint64_t *)p;
+    uint64_t pat = 0x0101010101010101ULL * c;
+
+    for (uint32_t i = 0; i < geo.bytes_per_page / 8; i++) {
+        if (w[i] != pat)
+            return 0;
+    }
+    return 1;
+}
+
+/* Whether a flash payload is the shared erased page */
+int vpage_is_blank(const uint8_t *data)
+{
+    return data != NULL && data == __atomic_load_n(&fill_ff, __ATOMIC_ACQUIRE);
+}
+
+/* Take a reference to the canonical buffer filled with byte c */
+static uint8_t *get_filled(uint8_t **canon, uint8_t c)
+{
+    uint8_t *p, *old;
+
+    if (__atomic_load_n(canon, __ATOMIC_ACQUIRE) == NULL) {
+        p = vpage_alloc_data();
+        memset(p, c, geo.bytes_per_page);
+        /* the reference taken here is never dropped */
+        old = NULL;
+        if (!__atomic_compare_exchange_n(canon, &old, p, 0,
+                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            vpage_free_data(p);
+    }
+    return vpage_share_data(*canon);
+}
+
+#ifdef VST_DEDUP
+static uint32_t page_hash(const uint8_t *p)
+{
+    const uint64_t *w = (const uint64_t *)p;
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    for (uint32_t i = 0; i < geo.bytes_per_page / 8; i++)
+        h = ((h << 5 | h >> 59) ^ w[i]) * 0x9e3779b97f4a7c15ULL;
+    return (uint32_t)(h >> 32);
+}
+
+/* Take a reference to a stored buffer equal to p, or return NULL */
+static uint8_t *dedup_find(const uint8_t *p, uint32_t h)
+{
+    uint32_t i, ref;
+    uint8_t *found = NULL;
+
+    pthread_mutex_lock(&dedup_lock);
+    for (i = dedup_head[h % DEDUP_BUCKETS]; i != 0; i = dedup_next[i - 1]) {
+        if (dedup_hash[i - 1] != h ||
+                memcmp(pool_buf(i - 1), p, geo.bytes_per_page) != 0)
+            continue;
+        /* skip a buffer whose last reference is being dropped */
+        ref = __atomic_load_n(&pool_ref[i - 1], __ATOMIC_ACQUIRE);
+        while (ref > 0 && !__atomic_compare_exchange_n(&pool_ref[i - 1],
+                &ref, ref + 1, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            ;
+        if (ref > 0) {
+            found = pool_buf(i - 1);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&dedup_lock);
+    return found;
+}
+
+static void dedup_insert(uint32_t idx, uint32_t h)
+{
+    uint32_t *head;
+
+    pthread_mutex_lock(&dedup_lock);
+    head = &dedup_head[h % DEDUP_BUCKETS];
+    dedup_hash[idx] = h;
+    dedup_next[idx] = *head;
+    *head = idx + 1;
+    dedup_in[idx] = 1;
+    pthread_mutex_unlock(&dedup_lock);
+}
+
+static void dedup_remove(uint32_t idx)
+{
+    uint32_t *pi;
+
+    if (!__atomic_load_n(&dedup_in[idx], __ATOMIC_ACQUIRE))
+        return;
+    pthread_mutex_lock(&dedup_lock);
+    pi = &dedup_head[dedup_hash[idx] % DEDUP_BUCKETS];
+    while (*pi != idx + 1)
+        pi = &dedup_next[*pi - 1];
+    *pi = dedup_next[idx];
+    dedup_in[idx] = 0;
+    pthread_mutex_unlock(&dedup_lock);
+}
+#endif
+
+/* Replace the shared payload of a page */
+static void set_shared(vpage_t *pp, uint8_t *payload)
+{
+    if (pp->shared != NULL) {
+        vpage_free_data(pp->shared);
+        n_shared_pages--;
+    }
+    pp->shared = payload;
+    if (payload != NULL)
+        n_shared_pages++;
+}
+
+/* Bring the data of a page up to date with its shared payload */
+void vpage_unshare(vpage_t *pp)
+{
+    if (pp->shared == NULL)
+        return;
+    memcpy(pp->data, pp->shared, geo.bytes_per_page);
+    set_shared(pp, NULL);
+}
+
+/* Release the pool; no buffer may be in use */
+void close_vpage_pool(void)
+{
+    if (pool_base != NULL)
+        munmap(pool_base, pool_size);
+    pool_base = NULL;
+    free(pool_ref);
+    pool_ref = NULL;
+    fill_ff = fill_00 = NULL;
+#ifdef VST_DEDUP
+    memset(dedup_head, 0, sizeof(dedup_head));
+    free(dedup_next);
+    free(dedup_hash);
+    free(dedup_in);
+    dedup_next = dedup_hash = NULL;
+    dedup_in = NULL;
+#endif
+    n_slab = 0;
+    pool_head = 0;
+}
+
 /**
  * VST prohibits saving both host data and metadata on the same page.
  */
@@ -18,7 +394,7 @@ void tag_page(vpage_t *pp)
     if (pp->tagged)
         return;
 
-    for (int i = 0; i < VST_SECTORS_PER_PAGE; i++)
+    for (uint32_t i = 0; i < geo.sectors_per_page; i++)
         pp->lbas[i] = -1;
     pp->tagged = 1;
 }
@@ -28,41 +404,145 @@ void untag_page(vpage_t *pp)
     pp->tagged = 0;
 }
 
-void vpage_init(vpage_t *pp, uint8_t *data)
+static inline int pack_lbas(vpage_tag_t *tag, const uint32_t *lbas,
+                            uint32_t n)
 {
-    pp->tagged = 0;
-    pp->data = data;
+    tag->base = 0;
+    tag->mask = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        if (lbas[i] == (uint32_t)-1)
+            continue;
+        if (tag->mask == 0)
+            tag->base = lbas[i] - i;
+        else if (lbas[i] != tag->base + i)
+            return 1;
+        tag->mask |= (uint32_t)1 << i;
+    }
+    return 0;
 }
 
-void vpage_copy(vpage_t *dst, vpage_t *src, uint32_t sect, uint32_t n_sect)
+static inline void unpack_lbas(uint32_t *lbas, const vpage_tag_t *tag,
+                               uint32_t n)
 {
-    assert(sect + n_sect <= VST_SECTORS_PER_PAGE);
+    for (uint32_t i = 0; i < n; i++)
+        lbas[i] = ((tag->mask >> i) & 1) ? tag->base + i : (uint32_t)-1;
+}
 
-    if (src->tagged == 1) {
+/**
+ * Pack the LBAs of the sectors of a page into a tag.  Returns 1 if they
+ * are not consecutive, in which case the full array must be kept.  Pages
+ * of the largest size get loops of constant length.
+ */
+int vpage_pack_lbas(vpage_tag_t *tag, const uint32_t *lbas)
+{
+    if (geo.sectors_per_page == VST_MAX_SECTORS_PER_PAGE)
+        return pack_lbas(tag, lbas, VST_MAX_SECTORS_PER_PAGE);
+    return pack_lbas(tag, lbas, geo.sectors_per_page);
+}
+
+void vpage_unpack_lbas(uint32_t *lbas, const vpage_tag_t *tag)
+{
+    if (geo.sectors_per_page == VST_MAX_SECTORS_PER_PAGE)
+        unpack_lbas(lbas, tag, VST_MAX_SECTORS_PER_PAGE);
+    else
+        unpack_lbas(lbas, tag, geo.sectors_per_page);
+}
+
+/**
+ * Load sectors of a flash page, given by its tag, LBAs and data, into a
+ * DRAM page.  A NULL data pointer reads as erased.
+ */
+void vpage_load(vpage_t *dst, int tagged, const uint32_t *lbas,
+                const uint8_t *data, uint32_t sect, uint32_t n_sect)
+{
+    assert(sect + n_sect <= geo.sectors_per_page);
+
+    if (tagged) {
         /* host data */
         tag_page(dst);
-        memcpy(&dst->lbas[sect], &src->lbas[sect], n_sect * sizeof(uint32_t));
+        memcpy(&dst->lbas[sect], &lbas[sect], n_sect * sizeof(uint32_t));
     } else {
         /* metadata */
         untag_page(dst);
+        if (sect == 0 && n_sect == geo.sectors_per_page) {
+            /* whole pages are shared until accessed */
+            set_shared(dst, (data != NULL) ? vpage_share_data((uint8_t *)data)
+                                           : get_filled(&fill_ff, 0xff));
+            return;
+        }
+        vpage_unshare(dst);
         if (dst->data == NULL)
-            dst->data = (uint8_t *)malloc(VST_BYTES_PER_PAGE * sizeof(uint8_t));
+            dst->data = vpage_alloc_data();
         uint32_t start, length;
-        start = sect * VST_BYTES_PER_SECTOR;
-        length = n_sect * VST_BYTES_PER_SECTOR;
-        if (src->data == NULL)
-            /* only flash page may be NULL */
+        start = sect * geo.bytes_per_sector;
+        length = n_sect * geo.bytes_per_sector;
+        if (data == NULL)
             memset(&dst->data[start], 0xff, length);
         else
-            memcpy(&dst->data[start], &src->data[start], length);
+            memcpy(&dst->data[start], &data[start], length);
     }
 }
 
-/* Should only be called by vflash */
-void vpage_free(vpage_t *pp)
+/**
+ * Store sectors of a DRAM page into an erased flash page, given by its
+ * LBAs and data.  Returns whether the flash page is now tagged.
+ */
+int vpage_store(const vpage_t *src, uint32_t *lbas, uint8_t **data,
+                uint32_t sect, uint32_t n_sect)
 {
-    pp->tagged = 0;
-    free(pp->data);
-    pp->data = NULL;
-    /* dont need to reset lbas as it will be done when the page is tagged */
+    assert(sect + n_sect <= geo.sectors_per_page);
+
+    if (src->tagged == 1) {
+        /* host data */
+        for (uint32_t i = 0; i < geo.sectors_per_page; i++)
+            lbas[i] = -1;
+        memcpy(&lbas[sect], &src->lbas[sect], n_sect * sizeof(uint32_t));
+        return 1;
+    }
+
+    /* metadata */
+    if (src->shared != NULL && sect == 0 && n_sect == geo.sectors_per_page) {
+        vpage_free_data(*data);
+        *data = vpage_share_data(src->shared);
+        return 0;
+    }
+    const uint8_t *bytes;
+    bytes = (src->shared != NULL) ? src->shared : src->data;
+    if (sect == 0 && n_sect == geo.sectors_per_page) {
+        uint8_t *dup;
+        if (bytes == NULL || is_filled(bytes, 0xff))
+            dup = get_filled(&fill_ff, 0xff);
+        else if (is_filled(bytes, 0))
+            dup = get_filled(&fill_00, 0);
+        else
+            dup = NULL;
+#ifdef VST_DEDUP
+        uint32_t h = 0;
+        if (dup == NULL) {
+            h = page_hash(bytes);
+            dup = dedup_find(bytes, h);
+        }
+#endif
+        if (dup != NULL) {
+            vpage_free_data(*data);
+            *data = dup;
+            return 0;
+        }
+        own_data(data);
+        memcpy(*data, bytes, geo.bytes_per_page);
+#ifdef VST_DEDUP
+        dedup_insert(pool_idx(*data), h);
+#endif
+        return 0;
+    }
+
+    own_data(data);
+    uint32_t start, length;
+    start = sect * geo.bytes_per_sector;
+    length = n_sect * geo.bytes_per_sector;
+    if (bytes == NULL)
+        memset(&(*data)[start], 0xff, length);
+    else
+        memcpy(&(*data)[start], &bytes[start], length);
+    return 0;
 }
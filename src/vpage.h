@@ -8,17 +8,50 @@
 
 #include <stdint.h>
 #include "config.h"
+#include "geometry.h"
 
 typedef struct {
     int tagged;
     uint8_t *data;
-    uint32_t lbas[VST_SECTORS_PER_PAGE];
+    /**
+     * immutable payload shared with flash that stands for the content of
+     * data until the page is accessed; NULL if data is up to date
+     */
+    uint8_t *shared;
+    uint32_t lbas[VST_MAX_SECTORS_PER_PAGE];
 } vpage_t;
 
+#if VST_MAX_SECTORS_PER_PAGE > 32
+#error "vpage_tag_t holds at most 32 sectors"
+#endif
+
+/**
+ * LBA tags of a host data page in compact form: sector i holds LBA base + i
+ * if bit i of mask is set and no host data otherwise.  Pages written from
+ * the write buffer almost always fit, possibly with a partial prefix or
+ * suffix.
+ */
+typedef struct {
+    uint32_t base;
+    uint32_t mask;
+} vpage_tag_t;
+
+/* number of pages with a shared payload */
+extern uint32_t n_shared_pages;
+
 void tag_page(vpage_t *pp);
 void untag_page(vpage_t *pp);
-void vpage_init(vpage_t *pp, uint8_t *data);
-void vpage_copy(vpage_t *dst, vpage_t *src, uint32_t sect, uint32_t n_sect);
-void vpage_free(vpage_t *pp);
+void vpage_load(vpage_t *dst, int tagged, const uint32_t *lbas,
+                const uint8_t *data, uint32_t sect, uint32_t n_sect);
+int vpage_store(const vpage_t *src, uint32_t *lbas, uint8_t **data,
+                uint32_t sect, uint32_t n_sect);
+void vpage_unshare(vpage_t *pp);
+int vpage_pack_lbas(vpage_tag_t *tag, const uint32_t *lbas);
+void vpage_unpack_lbas(uint32_t *lbas, const vpage_tag_t *tag);
+uint8_t *vpage_alloc_data(void);
+uint8_t *vpage_share_data(uint8_t *data);
+void vpage_free_data(uint8_t *data);
+int vpage_is_blank(const uint8_t *data);
+void close_vpage_pool(void);
 
 #endif // VPAGE_H
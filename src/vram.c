@@ -5,9 +5,11 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include "config.h"
+#include "geometry.h"
 #include "logger.h"
 #include "vram.h"
 #include "vpage.h"
@@ -20,18 +22,43 @@ typedef struct {
 } rw_buf_t;
 
 typedef struct {
-    vpage_t pages[VST_DRAM_SIZE / VST_BYTES_PER_PAGE];
+    vpage_t *pages;
+    uint32_t n_pages;
 } ram_t;
 
 /* emulated DRAM */
 uint8_t __attribute__((section (".dram"))) dram[VST_DRAM_SIZE];
 static ram_t vram;
 static rw_buf_t rbuf, wbuf;
-static uint8_t vers[VST_MAX_LBA];
+static uint8_t *vers;
+/* host sectors sent to each write buffer page since it was last programmed */
+static uint32_t *wbuf_host;
+
+/**
+ * Pages read from flash may still hold their content as a payload shared
+ * with flash.  Every access to DRAM content first brings the accessed pages
+ * up to date.
+ */
+static void sync_dram(uint64_t addr, uint32_t len)
+{
+    uint64_t first, last;
+
+    if (n_shared_pages == 0 || len == 0)
+        return;
+    if (addr >= VST_DRAM_BASE + VST_DRAM_SIZE || addr + len <= VST_DRAM_BASE)
+        return;
+    first = (addr < VST_DRAM_BASE) ? 0 : geo_page(addr - VST_DRAM_BASE);
+    last = geo_page(addr + len - 1 - VST_DRAM_BASE);
+    if (last >= vram.n_pages)
+        last = vram.n_pages - 1;
+    for (uint64_t i = first; i <= last; i++)
+        vpage_unshare(&vram.pages[i]);
+}
 
 /* RAM APIs */
 uint8_t vst_read_dram_8(uint64_t addr)
 {
+    sync_dram(addr, 1);
     return *(uint8_t *)addr;
 }
 
@@ -39,6 +66,7 @@ uint16_t vst_read_dram_16(uint64_t addr)
 {
     assert(!(addr & 1));
 
+    sync_dram(addr, 2);
     return *(uint16_t *)addr;
 }
 
@@ -46,11 +74,13 @@ uint32_t vst_read_dram_32(uint64_t addr)
 {
     assert(!(addr & 3));
 
+    sync_dram(addr, 4);
     return *(uint32_t *)addr;
 }
 
 void vst_write_dram_8(uint64_t addr, uint8_t val)
 {
+    sync_dram(addr, 1);
     *(uint8_t *)addr = val;
 }
 
@@ -58,6 +88,7 @@ void vst_write_dram_16(uint64_t addr, uint16_t val)
 {
     assert(!(addr & 1));
 
+    sync_dram(addr, 2);
     *(uint16_t *)addr = val;
 }
 
@@ -65,6 +96,7 @@ void vst_write_dram_32(uint64_t addr, uint32_t val)
 {
     assert(!(addr & 3));
 
+    sync_dram(addr, 4);
     *(uint32_t *)addr = val;
 }
 
@@ -73,6 +105,7 @@ void vst_set_bit_dram(uint64_t base_addr, uint32_t bit_offset)
     uint64_t addr = base_addr + bit_offset / 8;
     uint32_t offset = bit_offset % 8;
 
+    sync_dram(addr, 1);
     *(uint8_t *)addr = *(uint8_t *)addr | (1 << offset);
 }
 
@@ -81,6 +114,7 @@ void vst_clr_bit_dram(uint64_t base_addr, uint32_t bit_offset)
     uint64_t addr = base_addr + bit_offset / 8;
     uint32_t offset = bit_offset % 8;
 
+    sync_dram(addr, 1);
     *(uint8_t *)addr = *(uint8_t *)addr & ~(1 << offset);
 }
 
@@ -89,12 +123,16 @@ uint32_t vst_tst_bit_dram(uint64_t base_addr, uint32_t bit_offset)
     uint64_t addr = base_addr + bit_offset / 8;
     uint32_t offset = bit_offset % 8;
 
+    sync_dram(addr, 1);
     return (*(uint8_t *)addr) & (1 << offset);
 }
 
 void vst_memcpy(uint64_t dst, uint64_t src, uint32_t len)
 {
-    record(LOG_RAM, "memcpy: mem[0x%lx] -> mem[0x%lx] of len %u\n", src, dst, len);
+    record_event(EV_RAM_MEMCPY, 0, (uint32_t)dst, (uint32_t)(dst >> 32), 0,
+            len, src);
+    sync_dram(src, len);
+    sync_dram(dst, len);
 
     vpage_t *pp_dst, *pp_src;
     pp_dst = vram_vpage_map(dst);
@@ -117,7 +155,8 @@ void vst_memcpy(uint64_t dst, uint64_t src, uint32_t len)
                 memcpy((void *)dst, (void *)src, len);
             else
                 /* there's nothing we can do if dram is tagged */
-                record(LOG_RAM, "Try to move tagged DRAM data to SRAM\n");
+                record_event(EV_RAM_TAGGED_TO_SRAM, 0, (uint32_t)dst,
+                        (uint32_t)(dst >> 32), 0, len, src);
         } else {
             /* dram -> dram */
             vpage_t *pp_dst_end;
@@ -129,28 +168,29 @@ void vst_memcpy(uint64_t dst, uint64_t src, uint32_t len)
             } else {
                 for (vpage_t *pp = pp_dst; pp <= pp_dst_end; pp++)
                     tag_page(pp);
-                record(LOG_RAM, "Tagged data movement\n");
+                record_event(EV_RAM_TAGGED_COPY, 0, (uint32_t)dst,
+                        (uint32_t)(dst >> 32), 0, len, src);
                 /* only support sector-aligned tagged data copy */
-                if (dst % VST_BYTES_PER_SECTOR != 0 ||
-                        src % VST_BYTES_PER_SECTOR != 0 ||
-                        len % VST_BYTES_PER_SECTOR != 0) {
+                if (dst % geo.bytes_per_sector != 0 ||
+                        src % geo.bytes_per_sector != 0 ||
+                        len % geo.bytes_per_sector != 0) {
                     abort();
                 }
                 int x, y, n_sect;
-                x = dst % VST_BYTES_PER_PAGE / VST_BYTES_PER_SECTOR;
-                y = src % VST_BYTES_PER_PAGE / VST_BYTES_PER_SECTOR;
-                n_sect = len / VST_BYTES_PER_SECTOR;
+                x = geo_page_sect(dst);
+                y = geo_page_sect(src);
+                n_sect = len / geo.bytes_per_sector;
                 for (int i = 0; i < n_sect; i++) {
-                    record(LOG_RAM, "\tmem[%p] + sec[%d] -> mem[%p] + sec[%d], lba = %u\n",
-                            pp_src->data, y, pp_dst->data, x, pp_src->lbas[y]);
+                    record_event(EV_RAM_TAGGED_SECT, 0, pp_src->lbas[y], y, x,
+                            0, (uint64_t)pp_dst->data);
                     pp_dst->lbas[x] = pp_src->lbas[y];
                     x++;
                     y++;
-                    if (x == VST_SECTORS_PER_PAGE) {
+                    if (x == geo.sectors_per_page) {
                         x = 0;
                         pp_dst++;
                     }
-                    if (y == VST_SECTORS_PER_PAGE) {
+                    if (y == geo.sectors_per_page) {
                         y = 0;
                         pp_src++;
                     }
@@ -162,7 +202,8 @@ void vst_memcpy(uint64_t dst, uint64_t src, uint32_t len)
 
 void vst_memset(uint64_t addr, uint32_t val, uint32_t len)
 {
-    record(LOG_RAM, "memset: mem[0x%lx] of len %u\n", addr, len);
+    record_event(EV_RAM_MEMSET, 0, val, 0, 0, len, addr);
+    sync_dram(addr, len);
 
     vpage_t *pp_tgt;
     pp_tgt = vram_vpage_map(addr);
@@ -182,6 +223,8 @@ uint32_t vst_mem_search_min(uint64_t addr, uint32_t unit, uint32_t size)
     assert(!(addr % unit));
     assert(size != 0);
 
+    sync_dram(addr, unit * size);
+
     uint32_t i;
     uint32_t idx = 0;
     if (unit == 1) {
@@ -233,6 +276,8 @@ uint32_t vst_mem_search_max(uint64_t addr, uint32_t unit, uint32_t size)
     assert(unit == 1 || unit == 2 || unit == 4);
     assert(size != 0);
 
+    sync_dram(addr, unit * size);
+
     uint32_t i;
     uint32_t idx = 0;
     if (unit == 1) {
@@ -287,25 +332,38 @@ int open_ram(uint64_t raddr, uint32_t rsize, uint64_t waddr, uint32_t wsize)
 {
     memset(dram, 0, VST_DRAM_SIZE);
 
-    for (int i = 0; i < VST_DRAM_SIZE / VST_BYTES_PER_PAGE; i++) {
+    vram.n_pages = VST_DRAM_SIZE / geo.bytes_per_page;
+    vram.pages = (vpage_t *)calloc(vram.n_pages, sizeof(vpage_t));
+    vers = (uint8_t *)calloc(geo.max_lba + 1, sizeof(uint8_t));
+    if (vram.pages == NULL || vers == NULL) {
+        close_ram();
+        return 1;
+    }
+    for (uint32_t i = 0; i < vram.n_pages; i++) {
         vram.pages[i].tagged = 0;
-        vram.pages[i].data =
-                (uint8_t *)(uint64_t)(VST_DRAM_BASE + i * VST_BYTES_PER_PAGE);
+        vram.pages[i].shared = NULL;
+        vram.pages[i].data = (uint8_t *)(uint64_t)(VST_DRAM_BASE +
+                (uint64_t)i * geo.bytes_per_page);
     }
     record(LOG_RAM, "DRAM @ %x of size %u B\n", VST_DRAM_BASE, VST_DRAM_SIZE);
 
     assert(raddr >= VST_DRAM_BASE && raddr < VST_DRAM_BASE + VST_DRAM_SIZE);
-    assert((raddr - VST_DRAM_BASE) % VST_BYTES_PER_PAGE == 0);
-    rbuf.pages = &vram.pages[(raddr - VST_DRAM_BASE) / VST_BYTES_PER_PAGE];
+    assert((raddr - VST_DRAM_BASE) % geo.bytes_per_page == 0);
+    rbuf.pages = &vram.pages[geo_page(raddr - VST_DRAM_BASE)];
     rbuf.size = rsize;
     rbuf.ptr = 0;
     record(LOG_RAM, "Read buffer @ %lx of size %u\n", raddr, rsize);
 
     assert(waddr >= VST_DRAM_BASE && waddr < VST_DRAM_BASE + VST_DRAM_SIZE);
-    assert((waddr - VST_DRAM_BASE) % VST_BYTES_PER_PAGE == 0);
-    wbuf.pages = &vram.pages[(waddr - VST_DRAM_BASE) / VST_BYTES_PER_PAGE];
+    assert((waddr - VST_DRAM_BASE) % geo.bytes_per_page == 0);
+    wbuf.pages = &vram.pages[geo_page(waddr - VST_DRAM_BASE)];
     wbuf.size = wsize;
     wbuf.ptr = 0;
+    wbuf_host = (uint32_t *)calloc(wsize, sizeof(uint32_t));
+    if (wbuf_host == NULL) {
+        close_ram();
+        return 1;
+    }
     record(LOG_RAM, "Write buffer @ %lx of size %u\n", waddr, wsize);
 
     record(LOG_RAM, "Virtual RAM initialized\n");
@@ -314,6 +372,32 @@ int open_ram(uint64_t raddr, uint32_t rsize, uint64_t waddr, uint32_t wsize)
 
 void close_ram(void)
 {
+    free(vram.pages);
+    vram.pages = NULL;
+    free(vers);
+    vers = NULL;
+    free(wbuf_host);
+    wbuf_host = NULL;
+}
+
+/* Whether a DRAM page belongs to the write buffer */
+int vram_in_wbuf(const vpage_t *pp)
+{
+    return pp >= wbuf.pages && pp < wbuf.pages + wbuf.size;
+}
+
+/**
+ * Return the host sectors sent to a write buffer page since it was last
+ * taken, as the page is programmed
+ */
+uint32_t vram_take_host_sect(const vpage_t *pp)
+{
+    uint32_t i = (uint32_t)(pp - wbuf.pages), n;
+
+    assert(vram_in_wbuf(pp));
+    n = wbuf_host[i];
+    wbuf_host[i] = 0;
+    return n;
 }
 
 /* TODO: version checking */
@@ -323,12 +407,12 @@ void send_to_wbuf(uint32_t lba, uint32_t n_sect)
 
     l = lba;
     r = n_sect;
-    s = lba % VST_SECTORS_PER_PAGE;
+    s = geo_sect(lba);
     while (r > 0) {
-        if (s + r < VST_SECTORS_PER_PAGE)
+        if (s + r < geo.sectors_per_page)
             m = r;
         else
-            m = VST_SECTORS_PER_PAGE - s;
+            m = geo.sectors_per_page - s;
 
         tag_page(&wbuf.pages[wbuf.ptr]);
         for (uint32_t i = 0; i < m; i++) {
@@ -336,6 +420,8 @@ void send_to_wbuf(uint32_t lba, uint32_t n_sect)
             wbuf.pages[wbuf.ptr].lbas[s + i] = l + i;
             vers[l + i]++;
         }
+        wbuf_host[wbuf.ptr] += m;
+        chk_host_write(l, m);
         wbuf.ptr = (wbuf.ptr + 1) % wbuf.size;
 
         l += m;
@@ -350,12 +436,12 @@ void recv_from_rbuf(uint32_t lba, uint32_t n_sect)
 
     l = lba;
     r = n_sect;
-    s = lba % VST_SECTORS_PER_PAGE;
+    s = geo_sect(lba);
     while (r > 0) {
-        if (s + r < VST_SECTORS_PER_PAGE)
+        if (s + r < geo.sectors_per_page)
             m = r;
         else
-            m = VST_SECTORS_PER_PAGE - s;
+            m = geo.sectors_per_page - s;
 
         chk_lpn_consistent(&rbuf.pages[rbuf.ptr], l, s, m, vers);
         //printf("vst: %u\n", rbuf.ptr);
@@ -371,7 +457,7 @@ vpage_t *vram_vpage_map(uint64_t dram_addr)
 {
     if (dram_addr >= VST_DRAM_BASE &&
         dram_addr < VST_DRAM_BASE + VST_DRAM_SIZE) {
-        return &vram.pages[(dram_addr - VST_DRAM_BASE) / VST_BYTES_PER_PAGE];
+        return &vram.pages[geo_page(dram_addr - VST_DRAM_BASE)];
     }
     return NULL;
 }
@@ -34,5 +34,7 @@ void close_ram(void);
 void send_to_wbuf(uint32_t lba, uint32_t n_sect);
 void recv_from_rbuf(uint32_t lba, uint32_t n_sect);
 vpage_t *vram_vpage_map(uint64_t dram_addr);
+int vram_in_wbuf(const vpage_t *pp);
+uint32_t vram_take_host_sect(const vpage_t *pp);
 
 #endif // VRAM_H
@@ -0,0 +1,159 @@
+/**
+ * vst-logdump.c
+ * Event log renderer
+ * Authors: Yun-Sheng Chang
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include "logger.h"
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: ./vst-logdump [-t types] [-s first seq] [-n # events] <event log>\n");
+    fprintf(stderr, "       types: comma-separated io, flash, ram, misc\n");
+}
+
+static void print_event(uint32_t tid, const log_event_t *ev)
+{
+    uint64_t dst = (uint64_t)ev->page << 32 | ev->blk;
+
+    printf("%u:%" PRIu64 " ", tid, ev->seq);
+    switch (ev->op) {
+    case EV_IO_READ:
+        printf("[IO] R: (%u, %u)\n", ev->blk, ev->n);
+        break;
+    case EV_IO_WRITE:
+        printf("[IO] W: (%u, %u)\n", ev->blk, ev->n);
+        break;
+    case EV_FLASH_READ:
+        printf("[Flash] R: flash(%u, %u, %u, %u, %u) -> mem[0x%" PRIx64
+                "] + sec[%u]\n", ev->bank, ev->blk, ev->page, ev->sect,
+                ev->n, ev->addr, ev->sect);
+        break;
+    case EV_FLASH_WRITE:
+        printf("[Flash] W: mem[0x%" PRIx64 "] + sec[%u] -> flash(%u, %u, %u, "
+                "%u, %u)\n", ev->addr, ev->sect, ev->bank, ev->blk, ev->page,
+                ev->sect, ev->n);
+        break;
+    case EV_FLASH_COPYBACK:
+        printf("[Flash] CB: flash(%u, %u, %u) -> flash(%u, %u, %u)\n",
+                ev->bank, ev->blk, ev->page, ev->bank,
+                (uint32_t)(ev->addr >> 32), (uint32_t)ev->addr);
+        break;
+    case EV_FLASH_ERASE:
+        printf("[Flash] E: flash(%u, %u)\n", ev->bank, ev->blk);
+        break;
+    case EV_RAM_MEMCPY:
+        printf("[RAM] memcpy: mem[0x%" PRIx64 "] -> mem[0x%" PRIx64
+                "] of len %u\n", ev->addr, dst, ev->n);
+        break;
+    case EV_RAM_MEMSET:
+        printf("[RAM] memset: mem[0x%" PRIx64 "] of len %u to 0x%x\n",
+                ev->addr, ev->n, ev->blk);
+        break;
+    case EV_RAM_TAGGED_COPY:
+        printf("[RAM] Tagged data movement: mem[0x%" PRIx64 "] -> mem[0x%"
+                PRIx64 "] of len %u\n", ev->addr, dst, ev->n);
+        break;
+    case EV_RAM_TAGGED_SECT:
+        printf("[RAM] \tsec[%u] -> mem[0x%" PRIx64 "] + sec[%u], lba = %u\n",
+                ev->page, ev->addr, ev->sect, ev->blk);
+        break;
+    case EV_RAM_TAGGED_TO_SRAM:
+        printf("[RAM] Try to move tagged DRAM data to SRAM: mem[0x%" PRIx64
+                "] -> mem[0x%" PRIx64 "] of len %u\n", ev->addr, dst, ev->n);
+        break;
+    default:
+        printf("[?] op 0x%02x bank %u blk %u page %u sect %u n %u addr 0x%"
+                PRIx64 "\n", ev->op, ev->bank, ev->blk, ev->page, ev->sect,
+                ev->n, ev->addr);
+        break;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    struct ev_hdr hdr;
+    struct ev_block blk;
+    log_event_t ev, prev;
+    uint8_t *buf;
+    const uint8_t *p, *end;
+    uint32_t mask;
+    uint64_t first, count, n_out;
+    FILE *fp;
+    int i;
+
+    mask = UINT32_MAX;
+    first = 0;
+    count = UINT64_MAX;
+    for (i = 1; i < argc - 1 && argv[i][0] == '-'; i += 2) {
+        if (strcmp(argv[i], "-t") == 0) {
+            if (parse_log_types(argv[i + 1], &mask)) {
+                usage();
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-s") == 0) {
+            first = strtoull(argv[i + 1], NULL, 0);
+        } else if (strcmp(argv[i], "-n") == 0) {
+            count = strtoull(argv[i + 1], NULL, 0);
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    if (i != argc - 1) {
+        usage();
+        return 1;
+    }
+
+    fp = fopen(argv[i], "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "Fail opening %s.\n", argv[i]);
+        return 1;
+    }
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+            memcmp(hdr.magic, EV_MAGIC, sizeof(hdr.magic)) != 0 ||
+            hdr.version != EV_VERSION || hdr.rec_size != sizeof(log_event_t)) {
+        fprintf(stderr, "%s is not an event log of this version.\n", argv[i]);
+        fclose(fp);
+        return 1;
+    }
+
+    buf = NULL;
+    n_out = 0;
+    while (n_out < count && fread(&blk, sizeof(blk), 1, fp) == 1) {
+        uint8_t *q = (uint8_t *)realloc(buf, blk.n_byte);
+        if (q == NULL && blk.n_byte != 0)
+            break;
+        buf = q;
+        if (fread(buf, 1, blk.n_byte, fp) != blk.n_byte) {
+            fprintf(stderr, "Event log is truncated.\n");
+            break;
+        }
+        /* the first event of a block is relative to a zero event */
+        p = buf;
+        end = buf + blk.n_byte;
+        memset(&prev, 0, sizeof(prev));
+        prev.seq = UINT64_MAX;
+        for (uint32_t j = 0; j < blk.n_rec && n_out < count; j++) {
+            if (ev_decode(&p, end, &ev, &prev)) {
+                fprintf(stderr, "Event log is corrupted.\n");
+                n_out = count;
+                break;
+            }
+            if (ev.seq < first || !(mask >> EV_TYPE(ev.op) & 1))
+                continue;
+            print_event(blk.tid, &ev);
+            n_out++;
+        }
+    }
+    free(buf);
+    fclose(fp);
+    return 0;
+}
@@ -0,0 +1,136 @@
+/**
+ * vst-trace.c
+ * Trace file utility
+ * Authors: Yun-Sheng Chang
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include "trace.h"
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: ./vst-trace convert [-z] [-j threads] <trace file> <binary trace file>\n");
+    fprintf(stderr, "       ./vst-trace info <binary trace file>\n");
+    fprintf(stderr, "       ./vst-trace cat <trace file> [first entry [# entries]]\n");
+}
+
+static int do_convert(int argc, char *argv[])
+{
+    uint32_t encoding;
+    int n_thread;
+
+    encoding = TRACE_ENC_RAW;
+    n_thread = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    while (argc > 0 && argv[0][0] == '-') {
+        if (strcmp(argv[0], "-z") == 0) {
+            encoding = TRACE_ENC_VARINT;
+        } else if (strcmp(argv[0], "-j") == 0 && argc > 1) {
+            n_thread = atoi(argv[1]);
+            argc--;
+            argv++;
+        } else {
+            usage();
+            return 1;
+        }
+        argc--;
+        argv++;
+    }
+    if (argc != 2) {
+        usage();
+        return 1;
+    }
+    if (trace_convert(argv[0], argv[1], encoding, n_thread)) {
+        fprintf(stderr, "Fail converting %s to %s.\n", argv[0], argv[1]);
+        return 1;
+    }
+    return 0;
+}
+
+static int do_info(int argc, char *argv[])
+{
+    struct trace_hdr hdr;
+    uint64_t dur;
+
+    if (argc != 1) {
+        usage();
+        return 1;
+    }
+    if (trace_read_hdr(argv[0], &hdr)) {
+        fprintf(stderr, "%s is not a binary trace.\n", argv[0]);
+        return 1;
+    }
+    printf("Version: %u\n", hdr.version);
+    printf("Encoding: %s\n",
+            hdr.encoding == TRACE_ENC_VARINT ? "varint" : "raw");
+    printf("# entries: %" PRIu64 "\n", hdr.n_ent);
+    printf("# reads: %" PRIu64 "\n", hdr.n_read);
+    printf("# writes: %" PRIu64 "\n", hdr.n_ent - hdr.n_read);
+    printf("Max LBA: %" PRIu64 "\n", hdr.max_lba);
+    printf("Sector size: %u\n", hdr.bytes_per_sector);
+    /* version 1 traces carry no timestamps */
+    if (hdr.version > 1 && hdr.n_ent > 1) {
+        dur = hdr.last_ts - hdr.first_ts;
+        printf("Duration: %.6f s\n", dur / 1e9);
+        printf("Mean inter-arrival time: %.3f us\n",
+                dur / 1e3 / (hdr.n_ent - 1));
+    }
+    return 0;
+}
+
+static int do_cat(int argc, char *argv[])
+{
+    const struct trace_ent *ents;
+    uint64_t first, cnt;
+    uint32_t n;
+
+    if (argc < 1 || argc > 3) {
+        usage();
+        return 1;
+    }
+    first = (argc > 1) ? strtoull(argv[1], NULL, 0) : 0;
+    cnt = (argc > 2) ? strtoull(argv[2], NULL, 0) : UINT64_MAX;
+
+    if (open_trace(argv[0])) {
+        fprintf(stderr, "Fail opening trace file.\n");
+        return 1;
+    }
+    if (first > 0 && trace_seek(first)) {
+        fprintf(stderr, "Fail seeking to entry %" PRIu64 ".\n", first);
+        close_trace();
+        return 1;
+    }
+    while (cnt > 0 && (n = trace_read(&ents)) > 0) {
+        for (uint32_t i = 0; i < n && cnt > 0; i++, cnt--) {
+            printf("%" PRIu64 ".%09" PRIu64 " %u %u %u %u\n",
+                    ents[i].ts / 1000000000, ents[i].ts % 1000000000,
+                    ents[i].dev, ents[i].lba, ents[i].sec_num, ents[i].rw);
+        }
+    }
+    close_trace();
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        usage();
+        return 1;
+    }
+
+    if (strcmp(argv[1], "convert") == 0)
+        return do_convert(argc - 2, argv + 2);
+    if (strcmp(argv[1], "info") == 0)
+        return do_info(argc - 2, argv + 2);
+    if (strcmp(argv[1], "cat") == 0)
+        return do_cat(argc - 2, argv + 2);
+
+    usage();
+    return 1;
+}
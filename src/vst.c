@@ -2,30 +2,39 @@
  * main.c
  * Authors: Yun-Sheng Chang
  */
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <string.h>
 #include <time.h>
 #include <unistd.h>
 #include <getopt.h>
 #include <dlfcn.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
 #include "config.h"
+#include "geometry.h"
 #include "vflash.h"
 #include "vram.h"
 #include "stat.h"
 #include "logger.h"
 #include "checker.h"
+#include "trace.h"
+#include "synth.h"
+#include "timing.h"
+#include "results.h"
+#include "progress.h"
 
-#define MAX_SIZE_TRACE 168638965
-
-/* trace struct */
-struct trace_ent {
-    uint32_t lba, sec_num, rw;
-};
+#ifndef VST_VERSION
+#define VST_VERSION "unknown"
+#endif
 
 static void print_ssd_config(void);
-static int load_trace(FILE *fp_trace, struct trace_ent *traces);
+static void report_run(void);
+static uint64_t wall_ns(void);
 static void init(void);
 static void cleanup(void);
 
@@ -38,6 +47,20 @@ int trace_cnt;
 int pass = 0;
 static uint64_t raddr, waddr;
 static uint32_t rsize, wsize;
+static char *timing_spec;
+static char *series_file;
+static char *results_file;
+static char *trace_file, *ftl_file;
+static uint64_t bound, wall_begin;
+static double progress_s;
+static uint32_t log_types;
+static int log_policy = EV_BLOCK;
+static uint64_t flight_events;
+static uint32_t chk_threads;
+static int one_pass;
+static int synthetic;
+static double series_gb = 1;
+static uint32_t *chnl_map;
 
 /* unix getopt */
 extern char *optarg;
@@ -46,28 +69,36 @@ extern int optind;
 int main(int argc, char *argv[])
 {
     //TODO: make main conciser
-    FILE *fp_trace;
     void *handle;
     char *dl_err;
     int opt;
-    int one_pass;
-    uint64_t bound;
     uint32_t lba, sec_num, rw;
-    int size_trace;
+    uint64_t size_trace;
+    uint32_t n_ent;
+    uint64_t n_byte, lat, t0;
+    int wall;
     void (*vst_open_ftl)(void);
     void (*vst_read_sector)(uint32_t, uint32_t);
     void (*vst_write_sector)(uint32_t, uint32_t);
     void (*vst_flush_cache)(void);
     void (*vst_rwbuf_config)(uint64_t *, uint32_t *, uint64_t *, uint32_t *);
+    void (*vst_geometry_config)(uint32_t *, uint32_t *, uint32_t *,
+                                uint32_t *, uint32_t *, uint64_t *);
+    void (*vst_channel_config)(uint32_t *);
     int done;
-    struct trace_ent *traces;
-    char *fname;
+    const struct trace_ent *ents;
+    char *cache_dir;
+    char *geo_spec;
+    geometry_t ftl_geo;
 
     begin = clock();
+    wall_begin = wall_ns();
 
     one_pass = 0;
     bound = 1;
-    while ((opt = getopt(argc, argv, "ab:c")) != -1) {
+    cache_dir = NULL;
+    geo_spec = NULL;
+    while ((opt = getopt(argc, argv, "ab:cC:F:g:l:L:o:p:s:S:t:T:")) != -1) {
         switch (opt) {
         case 'a':
             bound = 1099511627776;
@@ -78,6 +109,54 @@ int main(int argc, char *argv[])
         case 'c':
             one_pass = 1;
             break;
+        case 'C':
+            chk_threads = atoi(optarg);
+            break;
+        case 'F':
+            flight_events = strtoull(optarg, NULL, 0);
+            break;
+        case 'g':
+            geo_spec = optarg;
+            break;
+        case 'l':
+            if (parse_log_types(optarg, &log_types)) {
+                fprintf(stderr, "Invalid log types %s.\n", optarg);
+                return 1;
+            }
+            if (log_types & ~LOG_BUILT) {
+                fprintf(stderr, "Log types %s are not all built in.\n",
+                        optarg);
+                return 1;
+            }
+            break;
+        case 'L':
+            if (strcmp(optarg, "block") == 0) {
+                log_policy = EV_BLOCK;
+            } else if (strcmp(optarg, "drop") == 0) {
+                log_policy = EV_DROP;
+            } else {
+                fprintf(stderr, "Invalid log policy %s.\n", optarg);
+                return 1;
+            }
+            break;
+        case 'o':
+            results_file = optarg;
+            break;
+        case 'p':
+            progress_s = atof(optarg);
+            break;
+        case 's':
+            series_file = optarg;
+            break;
+        case 'S':
+            series_gb = atof(optarg);
+            break;
+        case 't':
+            cache_dir = optarg;
+            break;
+        case 'T':
+            timing_spec = optarg;
+            break;
         default:
             fprintf(stderr, "Invalid option.\n");
             return 1;
@@ -88,13 +167,6 @@ int main(int argc, char *argv[])
         fprintf(stderr, "usage: ./vst trace_file ftl_obj\n");
         return 1;
     }
-    
-    fp_trace = fopen(argv[optind], "r");
-    if (fp_trace == NULL) {
-        fprintf(stderr, "Fail opening trace file.\n");
-        return 1;
-    }
-    fname = argv[optind];
 
     handle = dlopen(argv[optind + 1], RTLD_LAZY);
     if (handle == NULL) {
@@ -143,55 +215,139 @@ int main(int argc, char *argv[])
 
     vst_rwbuf_config(&raddr, &rsize, &waddr, &wsize);
 
+    /* FTLs without vst_geometry_config are taken to match config.h */
+    default_geometry();
+    vst_geometry_config = (void (*)(uint32_t *, uint32_t *, uint32_t *,
+            uint32_t *, uint32_t *, uint64_t *))dlsym(handle,
+            "vst_geometry_config");
+    if (vst_geometry_config != NULL)
+        vst_geometry_config(&geo.num_banks, &geo.blocks_per_bank,
+                &geo.pages_per_block, &geo.sectors_per_page,
+                &geo.bytes_per_sector, &geo.max_lba);
+    ftl_geo = geo;
+    if (geo_spec != NULL && parse_geometry(geo_spec)) {
+        fprintf(stderr, "Invalid geometry %s.\n", geo_spec);
+        return 1;
+    }
+    /* the FTL is built for its geometry; only its LBA range may shrink */
+    if (vst_geometry_config != NULL &&
+            (geo.num_banks != ftl_geo.num_banks ||
+            geo.blocks_per_bank != ftl_geo.blocks_per_bank ||
+            geo.pages_per_block != ftl_geo.pages_per_block ||
+            geo.sectors_per_page != ftl_geo.sectors_per_page ||
+            geo.bytes_per_sector != ftl_geo.bytes_per_sector ||
+            geo.max_lba > ftl_geo.max_lba)) {
+        fprintf(stderr, "Geometry does not match the FTL.\n");
+        return 1;
+    }
+    if (open_geometry()) {
+        fprintf(stderr, "Invalid geometry.\n");
+        return 1;
+    }
+
+    vst_channel_config = (void (*)(uint32_t *))dlsym(handle,
+            "vst_channel_config");
+    if (timing_spec != NULL && vst_channel_config != NULL) {
+        chnl_map = (uint32_t *)malloc(geo.num_banks * sizeof(uint32_t));
+        if (chnl_map == NULL)
+            return 1;
+        vst_channel_config(chnl_map);
+    }
+
+    /* synthetic workloads span the whole device by default */
+    if (strncmp(argv[optind], SYNTH_PREFIX, strlen(SYNTH_PREFIX)) == 0) {
+        synthetic = 1;
+        if (open_trace_synth(argv[optind], geo.max_lba + 1)) {
+            fprintf(stderr, "Fail opening synthetic workload.\n");
+            return 1;
+        }
+    } else {
+        if (cache_dir != NULL && open_trace_cached(argv[optind], cache_dir)) {
+            fprintf(stderr, "Fail using trace cache, reading trace directly.\n");
+            cache_dir = NULL;
+        }
+        if (cache_dir == NULL && open_trace(argv[optind])) {
+            fprintf(stderr, "Fail opening trace file.\n");
+            return 1;
+        }
+    }
+    trace_file = argv[optind];
+    ftl_file = argv[optind + 1];
+
     init();
 
-    record(LOG_GENERAL, "Trace file: %s\n", fname);
+    record(LOG_GENERAL, "Trace file: %s\n", trace_file);
 
     print_ssd_config();
     atexit(cleanup);
 
-    done = 0;
-    traces = (struct trace_ent *)malloc(MAX_SIZE_TRACE * 
-            sizeof(struct trace_ent));
-    size_trace = load_trace(fp_trace, traces);
+    /* without the timing model, latency is the time the FTL takes */
+    wall = !tm_enabled();
+    if (!wall)
+        set_latency_clock("simulated");
 
+    if (progress_s > 0 && open_progress(progress_s, one_pass ? 0 : bound))
+        fprintf(stderr, "Fail starting the progress reporter.\n");
+
+    done = 0;
+    t0 = 0;
     vst_open_ftl();
     while (!done) {
         record(LOG_GENERAL, "Trace id = %d\n", trace_cnt);
-        for (int i = 0; i < size_trace; i++) {
-            lba = traces[i].lba;
-            sec_num = traces[i].sec_num;
-            rw = traces[i].rw;
-            lba += (trace_cnt * 1024); // offset
-            if (lba > VST_MAX_LBA) {
-                lba %= (VST_MAX_LBA + 1);
-                traces[i].lba = lba;
-            }
-            if (lba + sec_num > VST_MAX_LBA + 1)
-                sec_num = VST_MAX_LBA + 1 - lba;
-            /* write */
-            if (rw == 0) {
-                record(LOG_IO, "W: (%u, %u)\n", lba, sec_num);
-                send_to_wbuf(lba, sec_num);
-                vst_write_sector(lba, sec_num);
-                inc_byte_write(sec_num * VST_BYTES_PER_SECTOR);
-                if (!one_pass && get_byte_write() > bound) {
-                    done = 1;
-                    break;
+        size_trace = 0;
+        while (!done && (n_ent = trace_read(&ents)) > 0) {
+            size_trace += n_ent;
+            for (uint32_t i = 0; i < n_ent; i++) {
+                lba = ents[i].lba;
+                sec_num = ents[i].sec_num;
+                rw = ents[i].rw;
+                /* the generator already varies across passes */
+                if (!synthetic)
+                    lba += (trace_cnt * 1024); // offset
+                if (lba > geo.max_lba)
+                    lba %= (geo.max_lba + 1);
+                if (lba + sec_num > geo.max_lba + 1)
+                    sec_num = geo.max_lba + 1 - lba;
+                n_byte = (uint64_t)sec_num * geo.bytes_per_sector;
+                tm_submit(ents[i].ts);
+                /* write */
+                if (rw == 0) {
+                    record_event(EV_IO_WRITE, 0, lba, 0, 0, sec_num, 0);
+                    send_to_wbuf(lba, sec_num);
+                    if (wall)
+                        t0 = wall_ns();
+                    vst_write_sector(lba, sec_num);
+                    lat = tm_complete(rw, n_byte);
+                    add_latency(rw, n_byte, wall ? wall_ns() - t0 : lat);
+                    inc_byte_write(n_byte);
+                    if (!one_pass && get_byte_write() > bound) {
+                        done = 1;
+                        break;
+                    }
+                }
+                /* read */
+                else {
+                    record_event(EV_IO_READ, 0, lba, 0, 0, sec_num, 0);
+                    if (wall)
+                        t0 = wall_ns();
+                    vst_read_sector(lba, sec_num);
+                    lat = tm_complete(rw, n_byte);
+                    add_latency(rw, n_byte, wall ? wall_ns() - t0 : lat);
+                    recv_from_rbuf(lba, sec_num);
+                    inc_byte_read(n_byte);
                 }
-            }
-            /* read */
-            else {
-                record(LOG_IO, "R: (%u, %u)\n", lba, sec_num);
-                vst_read_sector(lba, sec_num);
-                recv_from_rbuf(lba, sec_num);
-                inc_byte_read(sec_num * VST_BYTES_PER_SECTOR);
             }
         }
-        if (one_pass)
+        /* an empty trace would never reach the bound */
+        if (one_pass || size_trace == 0)
             done = 1;
         trace_cnt++;
+        if (!done) {
+            trace_rewind();
+            tm_rewind();
+        }
     }
+    close_series();
     vst_flush_cache();
     pass = 1;
 
@@ -204,56 +360,132 @@ int main(int argc, char *argv[])
 
 static void init(void)
 {
-    open_logger("./vst.log");
     /* open_logger must precede other open_xxx */
-    open_flash();
-    open_ram(raddr, rsize, waddr, wsize);
-    open_stat();
-    open_checker();
+    if (open_logger("./vst.log", "./vst.evlog", log_types, log_policy)) {
+        fprintf(stderr, "Fail opening the logs.\n");
+        exit(1);
+    }
+    if (open_flight("./vst.flight", flight_events)) {
+        fprintf(stderr, "Fail allocating the flight recorder.\n");
+        exit(1);
+    }
+    if (open_results(results_file)) {
+        fprintf(stderr, "Fail opening results file %s.\n", results_file);
+        exit(1);
+    }
+    if (open_flash() || open_ram(raddr, rsize, waddr, wsize)) {
+        fprintf(stderr, "Fail allocating the emulated SSD.\n");
+        exit(1);
+    }
+    if (open_timing(timing_spec, chnl_map)) {
+        fprintf(stderr, "Fail setting up the timing model.\n");
+        exit(1);
+    }
+    free(chnl_map);
+    if (open_stat(series_file, series_gb)) {
+        fprintf(stderr, "Fail setting up the statistics.\n");
+        exit(1);
+    }
+    if (open_checker(chk_threads)) {
+        fprintf(stderr, "Fail starting the checker threads.\n");
+        exit(1);
+    }
 }
 
 static void cleanup(void)
 {
+    close_progress();
+    /* queued checks decide whether the run passed */
+    close_checker();
+    /* the close_xxx below add their results */
+    report_run();
     close_flash();
     close_ram();
     close_stat();
-    close_checker();
+    close_timing();
+    close_trace();
+    close_results();
     /* close_logger must succeed other close_xxx */
+    close_flight();
     close_logger();
 }
 
 static void print_ssd_config(void)
 {
     printf("----------SSD Configuration----------\n");
-    printf("# banks: %d\n", VST_NUM_BANKS);
-    printf("# blocks: %d\n", VST_NUM_BLOCKS);
-    printf("# pages: %d\n", VST_NUM_PAGES);
-    printf("# sectors: %d\n", VST_NUM_SECTORS);
-    printf("# blocks per bank: %d\n", VST_BLOCKS_PER_BANK);
-    printf("# pages per block: %d\n", VST_PAGES_PER_BLOCK);
-    printf("# sectors per page: %d\n", VST_SECTORS_PER_PAGE);
-    printf("Max LBA: %d\n", VST_MAX_LBA);
-    printf("Sector size: %d\n", VST_BYTES_PER_SECTOR);
+    printf("# banks: %u\n", geo.num_banks);
+    printf("# blocks: %u\n", geo.num_blocks);
+    printf("# pages: %" PRIu64 "\n", geo.num_pages);
+    printf("# sectors: %" PRIu64 "\n", geo.num_sectors);
+    printf("# blocks per bank: %u\n", geo.blocks_per_bank);
+    printf("# pages per block: %u\n", geo.pages_per_block);
+    printf("# sectors per page: %u\n", geo.sectors_per_page);
+    printf("Max LBA: %" PRIu64 "\n", geo.max_lba);
+    printf("Sector size: %u\n", geo.bytes_per_sector);
     printf("DRAM base: 0x%x\n", VST_DRAM_BASE);
     printf("DRAM size: %d\n", VST_DRAM_SIZE);
     printf("----------SSD Configuration----------\n");
 }
 
-static int load_trace(FILE *fp_trace, struct trace_ent *traces)
+/* Size and modification time identify a file */
+static void report_file(const char *key, const char *path)
 {
-    char buf[64];
-    uint32_t rsv, lba, sec_num, rw;
-    int n = 0;
-
-    fseek(fp_trace, 0, SEEK_SET);
-    while (fscanf(fp_trace, "%s %d %d %d %d", 
-        buf, &rsv, &lba, &sec_num, &rw) != EOF &&
-        n < MAX_SIZE_TRACE) {
-        traces[n].lba = lba;
-        traces[n].sec_num = sec_num;
-        traces[n].rw = rw;
-        n++;
+    struct stat st;
+
+    res_begin(key);
+    res_str("path", path);
+    if (stat(path, &st) == 0) {
+        res_u64("size", st.st_size);
+        res_u64("mtime", st.st_mtime);
     }
-    fclose(fp_trace);
-    return n;
+    res_end();
+}
+
+/* Record what was run and how fast the simulator ran it */
+static void report_run(void)
+{
+    struct rusage ru;
+    char host[256];
+    double wall, cpu;
+
+    wall = (wall_ns() - wall_begin) / 1e9;
+    cpu = (double)(clock() - begin) / CLOCKS_PER_SEC;
+    if (gethostname(host, sizeof(host)) != 0)
+        host[0] = '\0';
+    host[sizeof(host) - 1] = '\0';
+
+    res_str("version", VST_VERSION);
+    res_u64("start", time(NULL) - (uint64_t)wall);
+    res_str("host", host);
+    report_file("trace", trace_file);
+    report_file("ftl", ftl_file);
+    res_begin("config");
+    res_u64("banks", geo.num_banks);
+    res_u64("blocks_per_bank", geo.blocks_per_bank);
+    res_u64("pages_per_block", geo.pages_per_block);
+    res_u64("sectors_per_page", geo.sectors_per_page);
+    res_u64("sector_size", geo.bytes_per_sector);
+    res_u64("lbas", geo.max_lba + 1);
+    res_u64("bound", bound);
+    res_bool("one_pass", one_pass);
+    res_str("timing", timing_spec);
+    res_end();
+    res_begin("run");
+    res_bool("pass", pass);
+    res_u64("passes", trace_cnt);
+    res_u64("requests", get_requests());
+    res_dbl("wall_s", wall);
+    res_dbl("cpu_s", cpu);
+    res_dbl("req_per_s", get_requests() / wall);
+    if (getrusage(RUSAGE_SELF, &ru) == 0)
+        res_u64("max_rss_kb", ru.ru_maxrss);
+    res_end();
+}
+
+static uint64_t wall_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }